@@ -0,0 +1,471 @@
+/*
+ * Converting rendered pixels to framebuffer values
+ *
+ * Page buffers store pixels in the framebuffer's depth of 2, 3 or 4
+ * bytes.  The scalar version looks up each channel in a table filled
+ * with fb_val().  If the framebuffer has 32-bit pixels with 8-bit
+ * channels at byte boundaries, which is the common case, the
+ * conversion is a byte shuffle and is done with SSSE3, AVX2 or NEON
+ * instructions, selected at runtime when available.
+ *
+ * Colour transforms (inverting, night and sepia modes, gamma) are
+ * applied to framebuffer pixels while rows are copied to the screen, so
+ * cached pages need not be rendered again when they change.  With the
+ * same 32-bit pixels, inverting is a vector xor and night mode without
+ * gamma is computed with vector multiplies; dividing by 255 is done as
+ * (x + (x >> 8) + 1) >> 8, which is exact for these products.  Other
+ * transforms look up each channel in a table.
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "draw.h"
+#include "doc.h"
+#include "conv.h"
+
+#define NIGHTFG		200	/* the text colour of night mode */
+#define NIGHTBG		24	/* the background colour of night mode */
+#define NIGHTSPAN	(NIGHTFG - NIGHTBG)
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONV_X86
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CONV_NEON
+#endif
+
+struct fmt {
+	int bytes;		/* bytes per source pixel */
+	int r, g, b;		/* channel offsets in source pixels */
+	unsigned char shuf[16];	/* byte shuffle for four pixels */
+};
+
+static struct fmt rgb24 = {3, 0, 1, 2};
+static struct fmt rgbx = {4, 0, 1, 2};
+static struct fmt bgrx = {4, 2, 1, 0};
+
+int fbbpp = 4;
+
+static fbval_t rt[256], gt[256], bt[256];	/* fb_val() of each channel */
+static int dr, dg, db;		/* channel bytes in 32-bit pixels; -1 if not byte aligned */
+static int bgr;			/* framebuffer pixels are blue, green and red bytes */
+
+static int fmode;		/* the colour transform; zero if none */
+static fbval_t fxor;		/* xor mask if the transform only inverts colours */
+static int fsepia;		/* map the luminance of pixels instead of each channel */
+static unsigned char flut[3][256];	/* output red, green and blue channels */
+static unsigned short *flut16;	/* the transform of every 16-bit pixel */
+static unsigned int fkeep;	/* the bytes of 32-bit pixels that are not channels */
+static int fnight;		/* night mode without gamma; computed instead of looked up */
+static int finvert;		/* invert the result of fnight */
+
+static void conv_scalar(struct fmt *fmt, void *dst, unsigned char *src, int n)
+{
+	unsigned char *d = dst;
+	fbval_t v;
+	int i;
+	for (i = 0; i < n; i++, src += fmt->bytes) {
+		v = rt[src[fmt->r]] | gt[src[fmt->g]] | bt[src[fmt->b]];
+		if (fbbpp == 4) {
+			((unsigned int *) d)[i] = v;
+		} else if (fbbpp == 2) {
+			((unsigned short *) d)[i] = v;
+		} else {
+			d[i * 3 + 0] = v;
+			d[i * 3 + 1] = v >> 8;
+			d[i * 3 + 2] = v >> 16;
+		}
+	}
+}
+
+static void (*conv)(struct fmt *fmt, void *dst, unsigned char *src, int n) = conv_scalar;
+
+static void xor_scalar(unsigned int *d, int n)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		d[i] ^= fxor;
+}
+
+/* look up the byte-aligned channels of pixels in flut */
+static void lut_scalar(unsigned char *d, int n)
+{
+	int i;
+	for (i = 0; i < n; i++, d += fbbpp) {
+		d[dr] = flut[0][d[dr]];
+		d[dg] = flut[1][d[dg]];
+		d[db] = flut[2][d[db]];
+	}
+}
+
+static void (*apply_xor)(unsigned int *d, int n) = xor_scalar;
+static void (*apply_night)(unsigned char *d, int n) = lut_scalar;
+
+#ifdef CONV_X86
+__attribute__((target("ssse3")))
+static void conv_ssse3(struct fmt *fmt, void *buf, unsigned char *src, int n)
+{
+	fbval_t *dst = buf;
+	__m128i shuf = _mm_loadu_si128((void *) fmt->shuf);
+	int last = fmt->bytes == 3 ? 6 : 4;	/* avoid reading past src */
+	int i = 0;
+	for (; i + last <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((void *) (src + i * fmt->bytes));
+		_mm_storeu_si128((void *) (dst + i), _mm_shuffle_epi8(s, shuf));
+	}
+	conv_scalar(fmt, dst + i, src + i * fmt->bytes, n - i);
+}
+
+__attribute__((target("avx2")))
+static void conv_avx2(struct fmt *fmt, void *buf, unsigned char *src, int n)
+{
+	fbval_t *dst = buf;
+	__m128i shuf128 = _mm_loadu_si128((void *) fmt->shuf);
+	__m256i shuf = _mm256_broadcastsi128_si256(shuf128);
+	int step = fmt->bytes * 4;	/* source bytes in each lane */
+	int last = fmt->bytes == 3 ? 10 : 8;
+	int i = 0;
+	for (; i + last <= n; i += 8) {
+		unsigned char *s = src + i * fmt->bytes;
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+				_mm_loadu_si128((void *) s)),
+				_mm_loadu_si128((void *) (s + step)), 1);
+		_mm256_storeu_si256((void *) (dst + i), _mm256_shuffle_epi8(v, shuf));
+	}
+	conv_ssse3(fmt, dst + i, src + i * fmt->bytes, n - i);
+}
+
+/* without pshufb: shift each channel of four-byte pixels into place */
+__attribute__((target("sse2")))
+static void conv_sse2(struct fmt *fmt, void *buf, unsigned char *src, int n)
+{
+	fbval_t *dst = buf;
+	__m128i mask = _mm_set1_epi32(0xff);
+	__m128i sr = _mm_cvtsi32_si128(fmt->r * 8), dsr = _mm_cvtsi32_si128(dr * 8);
+	__m128i sg = _mm_cvtsi32_si128(fmt->g * 8), dsg = _mm_cvtsi32_si128(dg * 8);
+	__m128i sb = _mm_cvtsi32_si128(fmt->b * 8), dsb = _mm_cvtsi32_si128(db * 8);
+	int i = 0;
+	if (fmt->bytes != 4) {
+		conv_scalar(fmt, dst, src, n);
+		return;
+	}
+	for (; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((void *) (src + i * 4));
+		__m128i r = _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(s, sr), mask), dsr);
+		__m128i g = _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(s, sg), mask), dsg);
+		__m128i b = _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(s, sb), mask), dsb);
+		_mm_storeu_si128((void *) (dst + i), _mm_or_si128(r, _mm_or_si128(g, b)));
+	}
+	conv_scalar(fmt, dst + i, src + i * 4, n - i);
+}
+
+__attribute__((target("sse2")))
+static void xor_sse2(unsigned int *d, int n)
+{
+	__m128i x = _mm_set1_epi32(fxor);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i *p = (void *) (d + i);
+		_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), x));
+	}
+	xor_scalar(d + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void xor_avx2(unsigned int *d, int n)
+{
+	__m256i x = _mm256_set1_epi32(fxor);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i *p = (void *) (d + i);
+		_mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), x));
+	}
+	xor_sse2(d + i, n - i);
+}
+
+/* night mode without gamma on eight 16-bit channels: v * NIGHTSPAN / 255 */
+__attribute__((target("sse2")))
+static __m128i night_sse2x8(__m128i v)
+{
+	__m128i x = _mm_mullo_epi16(v, _mm_set1_epi16(NIGHTSPAN));
+	x = _mm_add_epi16(x, _mm_srli_epi16(x, 8));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), 8);
+}
+
+__attribute__((target("sse2")))
+static void night_sse2(unsigned char *d, int n)
+{
+	__m128i keep = _mm_set1_epi32(fkeep);
+	__m128i base = _mm_set1_epi8(finvert ? 255 - NIGHTFG : NIGHTFG);
+	__m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i *p = (void *) (d + i * 4);
+		__m128i v = _mm_loadu_si128(p);
+		__m128i q = _mm_packus_epi16(night_sse2x8(_mm_unpacklo_epi8(v, zero)),
+				night_sse2x8(_mm_unpackhi_epi8(v, zero)));
+		__m128i r = finvert ? _mm_add_epi8(base, q) : _mm_sub_epi8(base, q);
+		_mm_storeu_si128(p, _mm_or_si128(_mm_and_si128(keep, v),
+				_mm_andnot_si128(keep, r)));
+	}
+	lut_scalar(d + i * 4, n - i);
+}
+
+__attribute__((target("avx2")))
+static __m256i night_avx2x16(__m256i v)
+{
+	__m256i x = _mm256_mullo_epi16(v, _mm256_set1_epi16(NIGHTSPAN));
+	x = _mm256_add_epi16(x, _mm256_srli_epi16(x, 8));
+	return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_set1_epi16(1)), 8);
+}
+
+__attribute__((target("avx2")))
+static void night_avx2(unsigned char *d, int n)
+{
+	__m256i keep = _mm256_set1_epi32(fkeep);
+	__m256i base = _mm256_set1_epi8(finvert ? 255 - NIGHTFG : NIGHTFG);
+	__m256i zero = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i *p = (void *) (d + i * 4);
+		__m256i v = _mm256_loadu_si256(p);
+		__m256i q = _mm256_packus_epi16(night_avx2x16(_mm256_unpacklo_epi8(v, zero)),
+				night_avx2x16(_mm256_unpackhi_epi8(v, zero)));
+		__m256i r = finvert ? _mm256_add_epi8(base, q) : _mm256_sub_epi8(base, q);
+		_mm256_storeu_si256(p, _mm256_or_si256(_mm256_and_si256(keep, v),
+				_mm256_andnot_si256(keep, r)));
+	}
+	night_sse2(d + i * 4, n - i);
+}
+#endif
+
+#ifdef CONV_NEON
+static void conv_neon(struct fmt *fmt, void *buf, unsigned char *src, int n)
+{
+	fbval_t *dst = buf;
+	uint8x16x4_t d;
+	int i = 0;
+	d.val[0] = d.val[1] = d.val[2] = d.val[3] = vdupq_n_u8(0);
+	for (; i + 16 <= n; i += 16) {
+		if (fmt->bytes == 3) {
+			uint8x16x3_t s = vld3q_u8(src + i * 3);
+			d.val[dr] = s.val[fmt->r];
+			d.val[dg] = s.val[fmt->g];
+			d.val[db] = s.val[fmt->b];
+		} else {
+			uint8x16x4_t s = vld4q_u8(src + i * 4);
+			d.val[dr] = s.val[fmt->r];
+			d.val[dg] = s.val[fmt->g];
+			d.val[db] = s.val[fmt->b];
+		}
+		vst4q_u8((uint8_t *) (dst + i), d);
+	}
+	conv_scalar(fmt, dst + i, src + i * fmt->bytes, n - i);
+}
+
+static void xor_neon(unsigned int *d, int n)
+{
+	uint32x4_t x = vdupq_n_u32(fxor);
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+		vst1q_u32(d + i, veorq_u32(vld1q_u32(d + i), x));
+	xor_scalar(d + i, n - i);
+}
+
+static uint8x8_t night_neonx8(uint8x8_t v)
+{
+	uint16x8_t x = vmull_u8(v, vdup_n_u8(NIGHTSPAN));
+	x = vaddq_u16(x, vshrq_n_u16(x, 8));
+	return vshrn_n_u16(vaddq_u16(x, vdupq_n_u16(1)), 8);
+}
+
+static void night_neon(unsigned char *d, int n)
+{
+	uint8x16_t keep = vreinterpretq_u8_u32(vdupq_n_u32(fkeep));
+	uint8x16_t base = vdupq_n_u8(finvert ? 255 - NIGHTFG : NIGHTFG);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		uint8x16_t v = vld1q_u8(d + i * 4);
+		uint8x16_t q = vcombine_u8(night_neonx8(vget_low_u8(v)),
+				night_neonx8(vget_high_u8(v)));
+		uint8x16_t r = finvert ? vaddq_u8(base, q) : vsubq_u8(base, q);
+		vst1q_u8(d + i * 4, vbslq_u8(keep, v, r));
+	}
+	lut_scalar(d + i * 4, n - i);
+}
+#endif
+
+/* the byte of 32-bit pixels holding the 8-bit channel of tab, or -1 */
+static int chanbyte(fbval_t *tab)
+{
+	int i, j;
+	for (j = 0; j < 4; j++) {
+		for (i = 0; i < 256; i++)
+			if (tab[i] != (fbval_t) i << (j * 8))
+				break;
+		if (i == 256)
+			return j;
+	}
+	return -1;
+}
+
+static void fmt_init(struct fmt *fmt)
+{
+	int i;
+	memset(fmt->shuf, 0x80, sizeof(fmt->shuf));	/* zero the other bytes */
+	for (i = 0; i < 4; i++) {
+		fmt->shuf[i * 4 + dr] = i * fmt->bytes + fmt->r;
+		fmt->shuf[i * 4 + dg] = i * fmt->bytes + fmt->g;
+		fmt->shuf[i * 4 + db] = i * fmt->bytes + fmt->b;
+	}
+}
+
+/* call after fb_init() */
+void conv_init(void)
+{
+	int i;
+	for (i = 0; i < 256; i++) {
+		rt[i] = FB_VAL(i, 0, 0);
+		gt[i] = FB_VAL(0, i, 0);
+		bt[i] = FB_VAL(0, 0, i);
+	}
+	fbbpp = FBM_BPP(fb_mode());
+	conv = conv_scalar;
+	apply_xor = xor_scalar;
+	apply_night = lut_scalar;
+	dr = chanbyte(rt);
+	dg = chanbyte(gt);
+	db = chanbyte(bt);
+	bgr = fbbpp >= 3 && db == 0 && dg == 1 && dr == 2;
+	if (fbbpp != 4 || dr < 0 || dg < 0 || db < 0 || getenv(CONV_NOSIMD))
+		return;
+	fkeep = ~(0xffu << (dr * 8) | 0xffu << (dg * 8) | 0xffu << (db * 8));
+	fmt_init(&rgb24);
+	fmt_init(&rgbx);
+	fmt_init(&bgrx);
+#ifdef CONV_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		conv = conv_avx2;
+		apply_xor = xor_avx2;
+		apply_night = night_avx2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+		conv = conv_ssse3;
+		apply_xor = xor_sse2;
+		apply_night = night_sse2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		conv = conv_sse2;
+		apply_xor = xor_sse2;
+		apply_night = night_sse2;
+	}
+#endif
+#ifdef CONV_NEON
+	conv = conv_neon;
+	apply_xor = xor_neon;
+	apply_night = night_neon;
+#endif
+}
+
+void conv_rgb24(void *dst, unsigned char *src, int n)
+{
+	conv(&rgb24, dst, src, n);
+}
+
+void conv_rgbx(void *dst, unsigned char *src, int n)
+{
+	conv(&rgbx, dst, src, n);
+}
+
+void conv_bgrx(void *dst, unsigned char *src, int n)
+{
+	conv(&bgrx, dst, src, n);
+}
+
+/* backends may render directly into page buffers in this layout */
+int conv_bgr(void)
+{
+	return bgr;
+}
+
+static fbval_t filter(fbval_t v)
+{
+	unsigned char rgb[3];
+	int r, g, b;
+	fb_rgb(v, rgb);
+	r = rgb[0];
+	g = rgb[1];
+	b = rgb[2];
+	if (fsepia)
+		r = g = b = (r * 77 + g * 150 + b * 29) >> 8;
+	return rt[flut[0][r]] | gt[flut[1][g]] | bt[flut[2][b]];
+}
+
+/*
+ * Set the colour transform: mode is CONV_NIGHT for light text on a dark
+ * background or CONV_SEPIA for dark text on warm paper; invert inverts
+ * the result and gamma is in tenths (10 changes nothing).
+ */
+void conv_filter(int mode, int invert, int gamma)
+{
+	static int paper[3] = {250, 236, 200}, ink[3] = {60, 40, 20};
+	int c, i, v;
+	fmode = mode || invert || gamma != 10;
+	fsepia = mode == CONV_SEPIA;
+	fnight = mode == CONV_NIGHT && gamma == 10;
+	finvert = invert;
+	fxor = mode || gamma != 10 ? 0 : rt[255] | gt[255] | bt[255];
+	for (c = 0; c < 3; c++) {
+		for (i = 0; i < 256; i++) {
+			v = i;
+			if (gamma != 10)
+				v = 255 * pow(v / 255., 10. / gamma) + .5;
+			if (mode == CONV_NIGHT)
+				v = NIGHTFG - v * NIGHTSPAN / 255;
+			if (mode == CONV_SEPIA)
+				v = ink[c] + v * (paper[c] - ink[c]) / 255;
+			flut[c][i] = invert ? 255 - v : v;
+		}
+	}
+	if (fmode && fbbpp == 2) {
+		if (!flut16)
+			flut16 = malloc(65536 * sizeof(flut16[0]));
+		for (i = 0; flut16 && i < 65536; i++)
+			flut16[i] = filter(i);
+	}
+}
+
+/* apply the colour transform to n framebuffer pixels */
+void conv_apply(void *buf, int n)
+{
+	unsigned char *d = buf;
+	int i;
+	if (!fmode)
+		return;
+	if (fxor && fbbpp == 4) {
+		apply_xor(buf, n);
+	} else if (fbbpp == 2 && flut16) {
+		for (i = 0; i < n; i++)
+			((unsigned short *) d)[i] = flut16[((unsigned short *) d)[i]];
+	} else if (fbbpp >= 3 && dr >= 0 && dg >= 0 && db >= 0 && !fsepia) {
+		if (fnight)
+			apply_night(buf, n);
+		else
+			lut_scalar(buf, n);
+	} else if (fbbpp >= 3 && dr >= 0 && dg >= 0 && db >= 0) {
+		for (i = 0; i < n; i++, d += fbbpp) {
+			int y = (d[dr] * 77 + d[dg] * 150 + d[db] * 29) >> 8;
+			d[dr] = flut[0][y];
+			d[dg] = flut[1][y];
+			d[db] = flut[2][y];
+		}
+	} else {
+		for (i = 0; i < n; i++, d += fbbpp) {
+			fbval_t v = 0;
+			memcpy(&v, d, fbbpp);
+			v = filter(v);
+			memcpy(d, &v, fbbpp);
+		}
+	}
+}
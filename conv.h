@@ -0,0 +1,15 @@
+/* converting rendered rows to framebuffer values */
+#define CONV_NOSIMD	"FBPDF_NOSIMD"	/* if set, use the scalar version */
+
+void conv_init(void);
+void conv_rgb24(void *dst, unsigned char *src, int n);
+void conv_rgbx(void *dst, unsigned char *src, int n);
+void conv_bgrx(void *dst, unsigned char *src, int n);
+int conv_bgr(void);
+
+/* colour transforms applied when drawing */
+#define CONV_NIGHT	1
+#define CONV_SEPIA	2
+
+void conv_filter(int mode, int invert, int gamma);
+void conv_apply(void *buf, int n);
@@ -0,0 +1,104 @@
+/*
+ * Benchmarking pixel conversion
+ *
+ * Random rows of the size of a letter page at 150 dpi are converted to
+ * a 32-bit memory framebuffer, with the SIMD kernel selected for this
+ * CPU and with the scalar version.  The inverting and night mode colour
+ * transforms are applied to the page in the same way.  The results should be identical; the
+ * time per page and the speedup are printed for each source format and
+ * transform.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "draw.h"
+#include "conv.h"
+
+#define ROWS		1650
+#define COLS		1275
+#define ROUNDS		20
+
+static long now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* convert the page ROUNDS times; return the time per page in microseconds */
+static long bench(void (*conv)(void *, unsigned char *, int), int bytes,
+		unsigned char *src, char *dst)
+{
+	long t = now();
+	int i, j;
+	for (i = 0; i < ROUNDS; i++)
+		for (j = 0; j < ROWS; j++)
+			conv(dst + j * COLS * 4, src + j * COLS * bytes, COLS);
+	return (now() - t) / ROUNDS;
+}
+
+/* apply the colour transform to the page ROUNDS times */
+static long bench_filter(char *buf)
+{
+	long t = now();
+	int i, j;
+	for (i = 0; i < ROUNDS; i++)
+		for (j = 0; j < ROWS; j++)
+			conv_apply(buf + j * COLS * 4, COLS);
+	return (now() - t) / ROUNDS;
+}
+
+/* print the times of both versions; return nonzero if their results differ */
+static int report(char *name, long t1, long t2, char *simd, char *scalar)
+{
+	int diff = memcmp(simd, scalar, ROWS * COLS * 4) != 0;
+	printf("%-7s simd %6.2f ms  scalar %6.2f ms  %5.1fx  %s\n",
+		name, t1 / 1000., t2 / 1000., t1 ? (double) t2 / t1 : 0.,
+		diff ? "MISMATCH" : "ok");
+	return diff;
+}
+
+int main(void)
+{
+	char *names[] = {"rgb24", "rgbx", "bgrx"};
+	void (*convs[])(void *, unsigned char *, int) = {conv_rgb24, conv_rgbx, conv_bgrx};
+	int bytes[] = {3, 4, 4};
+	char *fnames[] = {"invert", "night", "night+i"};
+	int fmodes[] = {0, CONV_NIGHT, CONV_NIGHT};
+	int finverts[] = {1, 0, 1};
+	unsigned char *src = malloc(ROWS * COLS * 4);
+	char *simd = malloc(ROWS * COLS * 4);
+	char *scalar = malloc(ROWS * COLS * 4);
+	long t1, t2;
+	int failed = 0;
+	int i;
+	if (!src || !simd || !scalar || fb_initmem("1x1x32"))
+		return 1;
+	for (i = 0; i < ROWS * COLS * 4; i++)
+		src[i] = rand();
+	for (i = 0; i < 3; i++) {
+		unsetenv(CONV_NOSIMD);
+		conv_init();
+		t1 = bench(convs[i], bytes[i], src, simd);
+		setenv(CONV_NOSIMD, "1", 1);
+		conv_init();
+		t2 = bench(convs[i], bytes[i], src, scalar);
+		failed |= report(names[i], t1, t2, simd, scalar);
+	}
+	for (i = 0; i < 3; i++) {
+		unsetenv(CONV_NOSIMD);
+		conv_init();
+		conv_filter(fmodes[i], finverts[i], 10);
+		memcpy(simd, src, ROWS * COLS * 4);
+		t1 = bench_filter(simd);
+		setenv(CONV_NOSIMD, "1", 1);
+		conv_init();
+		conv_filter(fmodes[i], finverts[i], 10);
+		memcpy(scalar, src, ROWS * COLS * 4);
+		t2 = bench_filter(scalar);
+		failed |= report(fnames[i], t1, t2, simd, scalar);
+	}
+	fb_free();
+	return failed;
+}
@@ -0,0 +1,228 @@
+/*
+ * Caching rendered pages on disk
+ *
+ * Each page is stored in a file of $XDG_CACHE_HOME/fbpdf, named after
+ * the identity of the document (its device, inode, size and modification
+ * time), the page, zoom and rotation, and the framebuffer pixel format.
+ * A header of HDR bytes precedes the pixels, so a file is mapped and its
+ * pixels are used in place.  Hits update the modification time of the
+ * file; when the cache grows beyond its limit, the files least recently
+ * used are removed.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "draw.h"
+#include "doc.h"
+#include "disk.h"
+#include "session.h"
+
+#define HDR		4096	/* the size of the header; keeps the pixels page-aligned */
+#define TMPAGE		60	/* temporary files older than this in seconds are stale */
+
+struct entry {
+	char name[64];
+	long size;
+	time_t mtime;
+};
+
+static char dir[512];		/* the cache directory; empty if disabled */
+static char id[128];		/* the identity of the document */
+static long limit;		/* maximum size of the cache in bytes */
+static long used;		/* the size of the cache */
+static void **maps;		/* mapped pages */
+static long *maplens;		/* the length of each mapping */
+static int nmaps, szmaps;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int entrycmp(const void *v1, const void *v2)
+{
+	const struct entry *e1 = v1, *e2 = v2;
+	return e1->mtime < e2->mtime ? -1 : e1->mtime > e2->mtime;
+}
+
+/*
+ * Remove the least recently used files until the cache is below size.
+ * Temporary files being written count against the limit; stale ones,
+ * left by a crash, are removed.
+ */
+static void trim(long size)
+{
+	struct entry *ents = NULL;
+	struct dirent *de;
+	struct stat st;
+	char path[1024];
+	time_t now = time(NULL);
+	int n = 0, sz = 0, i;
+	int tmp;
+	DIR *d;
+	if (!(d = opendir(dir)))
+		return;
+	used = 0;
+	while ((de = readdir(d))) {
+		tmp = !strncmp(de->d_name, ".tmp-", 5);
+		if ((de->d_name[0] == '.' && !tmp) || strlen(de->d_name) >= sizeof(ents[0].name))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (stat(path, &st) || !S_ISREG(st.st_mode))
+			continue;
+		if (tmp) {
+			if (st.st_mtime + TMPAGE < now)
+				unlink(path);
+			else
+				used += st.st_size;
+			continue;
+		}
+		if (n == sz) {
+			sz = sz ? sz * 2 : 256;
+			ents = realloc(ents, sz * sizeof(ents[0]));
+		}
+		strcpy(ents[n].name, de->d_name);
+		ents[n].size = st.st_size;
+		ents[n].mtime = st.st_mtime;
+		used += st.st_size;
+		n++;
+	}
+	closedir(d);
+	qsort(ents, n, sizeof(ents[0]), entrycmp);
+	for (i = 0; i < n && used > size; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, ents[i].name);
+		if (!unlink(path))
+			used -= ents[i].size;
+	}
+	free(ents);
+}
+
+/* cache the pages of the document at path in at most size bytes */
+int disk_init(char *path, long size)
+{
+	struct stat st;
+	char *home = getenv("HOME");
+	dir[0] = '\0';
+	limit = size;
+	if (size <= 0 || stat(path, &st))
+		return 1;
+	if (getenv("XDG_CACHE_HOME"))
+		snprintf(dir, sizeof(dir), "%s/fbpdf", getenv("XDG_CACHE_HOME"));
+	else if (home)
+		snprintf(dir, sizeof(dir), "%s/.cache/fbpdf", home);
+	if (dir[0])
+		mkdirs(dir);
+	if (!dir[0] || access(dir, W_OK | X_OK)) {
+		dir[0] = '\0';
+		return 1;
+	}
+	snprintf(id, sizeof(id), "%lx-%lx-%lx-%lx",
+		(long) st.st_dev, (long) st.st_ino,
+		(long) st.st_size, (long) st.st_mtime);
+	pthread_mutex_lock(&lock);
+	trim(limit);
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+static void pagepath(char *path, int len, int page, int zoom, int rotate)
+{
+	snprintf(path, len, "%s/%s-%d-%d-%d-%d-%x", dir, id,
+		page, zoom, rotate, fbbpp, FB_VAL(255, 0, 0));
+}
+
+/* map a cached page; release it with disk_unmap() */
+void *disk_load(int page, int zoom, int rotate, int *rows, int *cols)
+{
+	char path[1024];
+	char hdr[64] = "";
+	struct stat st;
+	int r, c, bpp;
+	void *addr;
+	int fd;
+	if (!dir[0])
+		return NULL;
+	pagepath(path, sizeof(path), page, zoom, rotate);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) || read(fd, hdr, sizeof(hdr) - 1) <= 0 ||
+			sscanf(hdr, "fbpdf %d %d %d", &r, &c, &bpp) != 3 ||
+			bpp != fbbpp || st.st_size != HDR + (long) r * c * bpp) {
+		close(fd);
+		return NULL;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	futimens(fd, NULL);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return NULL;
+	pthread_mutex_lock(&lock);
+	if (nmaps == szmaps) {
+		szmaps = szmaps ? szmaps * 2 : 64;
+		maps = realloc(maps, szmaps * sizeof(maps[0]));
+		maplens = realloc(maplens, szmaps * sizeof(maplens[0]));
+	}
+	maps[nmaps] = addr;
+	maplens[nmaps] = st.st_size;
+	nmaps++;
+	pthread_mutex_unlock(&lock);
+	*rows = r;
+	*cols = c;
+	return (char *) addr + HDR;
+}
+
+/* store a rendered page; written to a temporary file and renamed */
+void disk_save(int page, int zoom, int rotate, void *pbuf, int rows, int cols)
+{
+	char path[1024], tmp[1024];
+	char hdr[HDR] = "";
+	long size = (long) rows * cols * fbbpp;
+	int fd;
+	if (!dir[0] || HDR + size > limit)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s/.tmp-XXXXXX", dir);
+	if ((fd = mkstemp(tmp)) < 0)
+		return;
+	snprintf(hdr, sizeof(hdr), "fbpdf %d %d %d\n", rows, cols, fbbpp);
+	if (write(fd, hdr, HDR) != HDR || write(fd, pbuf, size) != size) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	close(fd);
+	pagepath(path, sizeof(path), page, zoom, rotate);
+	if (rename(tmp, path)) {
+		unlink(tmp);
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	used += HDR + size;
+	if (used > limit)
+		trim(limit - limit / 4);
+	pthread_mutex_unlock(&lock);
+}
+
+/* unmap a page returned by disk_load(); return nonzero if pbuf is not mapped */
+int disk_unmap(void *pbuf)
+{
+	int ret = 1;
+	int i;
+	if (!pbuf)
+		return 1;
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < nmaps; i++) {
+		if (maps[i] == (char *) pbuf - HDR) {
+			munmap(maps[i], maplens[i]);
+			nmaps--;
+			maps[i] = maps[nmaps];
+			maplens[i] = maplens[nmaps];
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
@@ -0,0 +1,5 @@
+/* caching rendered pages on disk */
+int disk_init(char *path, long size);
+void *disk_load(int page, int zoom, int rotate, int *rows, int *cols);
+void disk_save(int page, int zoom, int rotate, void *pbuf, int rows, int cols);
+int disk_unmap(void *pbuf);
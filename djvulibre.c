@@ -1,17 +1,35 @@
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <libdjvu/ddjvuapi.h>
 #include "draw.h"
 #include "doc.h"
+#include "conv.h"
+#include "trace.h"
 
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define BAND		128	/* rows rendered between checks for cancellation */
 
 struct doc {
 	ddjvu_context_t *ctx;
 	ddjvu_document_t *doc;
+	char *path;
+	ddjvu_page_t *page;	/* the page being decoded */
+	int cancel;		/* set by doc_cancel() */
+	pthread_mutex_t lock;	/* protects page and cancel */
 };
 
+static int cancelled(struct doc *doc)
+{
+	int ret;
+	pthread_mutex_lock(&doc->lock);
+	ret = doc->cancel;
+	pthread_mutex_unlock(&doc->lock);
+	return ret;
+}
+
 int djvu_handle(struct doc *doc)
 {
 	ddjvu_message_t *msg;
@@ -26,92 +44,250 @@ int djvu_handle(struct doc *doc)
 	return 0;
 }
 
-static void djvu_render(ddjvu_page_t *page, int iw, int ih, void *bitmap)
+/* render the part of the page in the rectangle x, y, w, h */
+static void djvu_render(ddjvu_page_t *page, int iw, int ih,
+		int x, int y, int w, int h, void *bitmap)
 {
 	ddjvu_format_t *fmt;
-	ddjvu_rect_t rect;
-	rect.x = 0;
-	rect.y = 0;
-	rect.w = iw;
-	rect.h = ih;
+	ddjvu_rect_t prect, rrect;
+	prect.x = 0;
+	prect.y = 0;
+	prect.w = iw;
+	prect.h = ih;
+	rrect.x = x;
+	rrect.y = y;
+	rrect.w = w;
+	rrect.h = h;
 	fmt = ddjvu_format_create(DDJVU_FORMAT_RGB24, 0, 0);
 	ddjvu_format_set_row_order(fmt, 1);
-	memset(bitmap, 0, ih * iw * 3);
+	memset(bitmap, 0, h * w * 3);
 	ddjvu_page_render(page, DDJVU_RENDER_COLOR,
-				&rect, &rect, fmt, iw * 3, bitmap);
+				&prect, &rrect, fmt, w * 3, bitmap);
 	ddjvu_format_release(fmt);
 }
 
-void *doc_draw(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
+/* load and decode a page; iw and ih are its dimensions at zoom */
+static ddjvu_page_t *djvu_page(struct doc *doc, int p, int zoom, int rotate,
+		int *iw, int *ih)
 {
 	ddjvu_page_t *page;
-	ddjvu_pageinfo_t info;
-	int iw, ih, dpi;
-	unsigned char *bmp;
-	fbval_t *pbuf;
-	int i, j;
+	long t = trace_now();
+	int dpi;
+	if (cancelled(doc))
+		return NULL;
 	page = ddjvu_page_create_by_pageno(doc->doc, p - 1);
 	if (!page)
 		return NULL;
+	pthread_mutex_lock(&doc->lock);
+	doc->page = page;
+	pthread_mutex_unlock(&doc->lock);
 	while (!ddjvu_page_decoding_done(page))
 		if (djvu_handle(doc))
-			return NULL;
+			break;
+	pthread_mutex_lock(&doc->lock);
+	doc->page = NULL;
+	pthread_mutex_unlock(&doc->lock);
+	if (ddjvu_page_decoding_status(page) != DDJVU_JOB_OK) {
+		ddjvu_page_release(page);
+		return NULL;
+	}
 	if (rotate)
 		ddjvu_page_set_rotation(page, (4 - (rotate / 90 % 4)) & 3);
-	ddjvu_document_get_pageinfo(doc->doc, p - 1, &info);
 	dpi = ddjvu_page_get_resolution(page);
-	iw = ddjvu_page_get_width(page) * zoom * 10 / dpi;
-	ih = ddjvu_page_get_height(page) * zoom * 10 / dpi;
-	if (!(bmp = malloc(ih * iw * 3))) {
-		ddjvu_page_release(page);
-		return NULL;
+	*iw = ddjvu_page_get_width(page) * zoom * 10 / dpi;
+	*ih = ddjvu_page_get_height(page) * zoom * 10 / dpi;
+	trace_lap(TR_RASTER, t);
+	return page;
+}
+
+/* render the rectangle in bands and convert it into buf */
+static int djvu_rect(struct doc *doc, ddjvu_page_t *page, int iw, int ih,
+		int x, int y, int w, int h, char *buf, int stride)
+{
+	unsigned char *bmp;
+	int i, j, n;
+	if (!(bmp = malloc(MIN(BAND, h) * w * 3)))
+		return 1;
+	for (i = 0; i < h; i += n) {
+		long t = trace_now();
+		n = MIN(BAND, h - i);
+		if (cancelled(doc))
+			break;
+		djvu_render(page, iw, ih, x, y + i, w, n, bmp);
+		t = trace_lap(TR_RASTER, t);
+		for (j = 0; j < n; j++)
+			conv_rgb24(buf + (i + j) * stride, bmp + j * w * 3, w);
+		trace_lap(TR_CONV, t);
 	}
-	djvu_render(page, iw, ih, bmp);
-	ddjvu_page_release(page);
-	if (!(pbuf = malloc(ih * iw * sizeof(pbuf[0])))) {
-		free(bmp);
+	free(bmp);
+	return i < h;
+}
+
+void *doc_draw(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
+{
+	ddjvu_page_t *page;
+	char *pbuf;
+	int iw, ih;
+	if (!(page = djvu_page(doc, p, zoom, rotate, &iw, &ih)))
 		return NULL;
+	pbuf = malloc(ih * iw * fbbpp);
+	if (pbuf && djvu_rect(doc, page, iw, ih, 0, 0, iw, ih, pbuf, iw * fbbpp)) {
+		free(pbuf);
+		pbuf = NULL;
 	}
-	for (i = 0; i < ih; i++) {
-		unsigned char *src = bmp + i * iw * 3;
-		fbval_t *dst = pbuf + i * iw;
-		for (j = 0; j < iw; j++)
-			dst[j] = FB_VAL(src[j * 3], src[j * 3 + 1], src[j * 3 + 2]);
-	}
-	free(bmp);
+	ddjvu_page_release(page);
 	*cols = iw;
 	*rows = ih;
 	return pbuf;
 }
 
+int doc_render(struct doc *doc, int p, int zoom, int rotate,
+		int x, int y, int w, int h, void *buf, int stride)
+{
+	ddjvu_page_t *page;
+	int ret;
+	int iw, ih;
+	if (!(page = djvu_page(doc, p, zoom, rotate, &iw, &ih)))
+		return 1;
+	ret = djvu_rect(doc, page, iw, ih, x, y, w, h, buf, stride);
+	ddjvu_page_release(page);
+	return ret;
+}
+
+int doc_size(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
+{
+	ddjvu_pageinfo_t info;
+	ddjvu_status_t r;
+	int quarters;
+	while ((r = ddjvu_document_get_pageinfo(doc->doc, p - 1, &info)) < DDJVU_JOB_OK)
+		if (djvu_handle(doc))
+			return 1;
+	if (r != DDJVU_JOB_OK)
+		return 1;
+	quarters = rotate ? (4 - (rotate / 90 % 4)) & 3 : info.rotation;
+	*cols = (quarters & 1 ? info.height : info.width) * zoom * 10 / info.dpi;
+	*rows = (quarters & 1 ? info.width : info.height) * zoom * 10 / info.dpi;
+	return 0;
+}
+
+/* fbpdf finds the contents in the rendered page */
+int doc_bbox(struct doc *doc, int p, int rotate, int *box)
+{
+	return 1;
+}
+
+/* write the words of the text expression exp */
+static void djvu_words(FILE *fp, miniexp_t exp)
+{
+	char *s;
+	int i = 0;
+	for (exp = miniexp_cdr(exp); miniexp_consp(exp); exp = miniexp_cdr(exp)) {
+		if (i++ < 4)		/* the coordinates */
+			continue;
+		if (miniexp_stringp(miniexp_car(exp))) {
+			for (s = (char *) miniexp_to_str(miniexp_car(exp)); *s; s++)
+				fputc(*s == '\n' ? ' ' : *s, fp);
+			fputc(' ', fp);
+		} else {
+			djvu_words(fp, miniexp_car(exp));
+		}
+	}
+}
+
+/* write the lines in the text expression exp of a w by h page */
+static void djvu_lines(FILE *fp, miniexp_t exp, int w, int h)
+{
+	int i = 0;
+	if (miniexp_car(exp) == miniexp_symbol("line")) {
+		fprintf(fp, "%d %d ",
+			miniexp_to_int(miniexp_nth(1, exp)) * BBOX_UNIT / w,
+			(h - miniexp_to_int(miniexp_nth(4, exp))) * BBOX_UNIT / h);
+		djvu_words(fp, exp);
+		fputc('\n', fp);
+		return;
+	}
+	for (exp = miniexp_cdr(exp); miniexp_consp(exp); exp = miniexp_cdr(exp))
+		if (i++ >= 4 && miniexp_consp(miniexp_car(exp)))
+			djvu_lines(fp, miniexp_car(exp), w, h);
+}
+
+/* the hidden text layer; its origin is the bottom left corner of the page */
+char *doc_text(struct doc *doc, int p)
+{
+	miniexp_t exp;
+	char *s = NULL;
+	size_t len;
+	FILE *fp;
+	int w, h;
+	while ((exp = ddjvu_document_get_pagetext(doc->doc, p - 1, "line")) == miniexp_dummy)
+		if (djvu_handle(doc))
+			return NULL;
+	if (!(fp = open_memstream(&s, &len))) {
+		ddjvu_miniexp_release(doc->doc, exp);
+		return NULL;
+	}
+	w = miniexp_to_int(miniexp_nth(3, exp));
+	h = miniexp_to_int(miniexp_nth(4, exp));
+	if (miniexp_consp(exp) && w > 0 && h > 0)
+		djvu_lines(fp, exp, w, h);
+	fclose(fp);
+	ddjvu_miniexp_release(doc->doc, exp);
+	return s;
+}
+
+/* decoding is stopped by ddjvu; rendering is checked between bands */
+void doc_cancel(struct doc *doc, int cancel)
+{
+	pthread_mutex_lock(&doc->lock);
+	doc->cancel = cancel;
+	if (cancel && doc->page)
+		ddjvu_job_stop(ddjvu_page_job(doc->page));
+	pthread_mutex_unlock(&doc->lock);
+}
+
+/* pages are rendered in one thread */
+void doc_threads(struct doc *doc, int n)
+{
+}
+
 int doc_pages(struct doc *doc)
 {
+	while (!ddjvu_document_decoding_done(doc->doc))
+		if (djvu_handle(doc))
+			return 0;
 	return ddjvu_document_get_pagenum(doc->doc);
 }
 
 struct doc *doc_open(char *path)
 {
-	struct doc *doc = malloc(sizeof(*doc));
+	struct doc *doc = calloc(1, sizeof(*doc));
+	pthread_mutex_init(&doc->lock, NULL);
+	doc->path = strdup(path);
 	doc->ctx = ddjvu_context_create("fbpdf");
 	if (!doc->ctx)
 		goto fail;
 	doc->doc = ddjvu_document_create_by_filename(doc->ctx, path, 1);
-	if (!doc->doc)
+	if (!doc->doc || ddjvu_document_decoding_error(doc->doc))
 		goto fail;
-	while (!ddjvu_document_decoding_done(doc->doc))
-		if (djvu_handle(doc))
-			goto fail;
-	return doc;
+	return doc;	/* pages are decoded before the whole document */
 fail:
 	doc_close(doc);
 	return NULL;
 }
 
+/* each handle has its own ddjvu context; they can be used in parallel */
+struct doc *doc_clone(struct doc *doc)
+{
+	return doc_open(doc->path);
+}
+
 void doc_close(struct doc *doc)
 {
 	if (doc->doc)
-		ddjvu_context_release(doc->ctx);
-	if (doc->ctx)
 		ddjvu_document_release(doc->doc);
+	if (doc->ctx)
+		ddjvu_context_release(doc->ctx);
+	pthread_mutex_destroy(&doc->lock);
+	free(doc->path);
 	free(doc);
 }
@@ -1,10 +1,30 @@
-/* framebuffer depth */
+/* framebuffer pixel values */
 typedef unsigned int fbval_t;
 
+/* bytes per pixel in page buffers; the depth of the framebuffer */
+extern int fbbpp;
+
+/* doc_bbox() coordinates: the width or height of the page */
+#define BBOX_UNIT	10000
+
 /* optimized version of fb_val() */
 #define FB_VAL(r, g, b)	fb_val((r), (g), (b))
 
 struct doc *doc_open(char *path);
+struct doc *doc_clone(struct doc *doc);
+/* the number of pages; it may wait for the whole document to be read */
 int doc_pages(struct doc *doc);
 void *doc_draw(struct doc *doc, int page, int zoom, int rotate, int *rows, int *cols);
+/* render the w by h rectangle at x, y of the page into buf; stride is in bytes */
+int doc_render(struct doc *doc, int page, int zoom, int rotate,
+		int x, int y, int w, int h, void *buf, int stride);
+int doc_size(struct doc *doc, int page, int zoom, int rotate, int *rows, int *cols);
+/* the bounding box of the page contents: x0, y0, x1, y1 in BBOX_UNIT */
+int doc_bbox(struct doc *doc, int page, int rotate, int *box);
+/* the text of the page: a line "x y text" for each line, x and y in BBOX_UNIT of the unrotated page */
+char *doc_text(struct doc *doc, int page);
+/* render each page of doc with n threads, if supported */
+void doc_threads(struct doc *doc, int n);
+/* while cancel is nonzero, renders of doc fail early; may be called from other threads */
+void doc_cancel(struct doc *doc, int cancel);
 void doc_close(struct doc *doc);
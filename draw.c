@@ -19,6 +19,12 @@ static struct fb_fix_screeninfo finfo;
 static int bpp;
 static int nr, ng, nb;
 static int rl, rr, gl, gr, bl, br;	/* fb_color() shifts */
+static int yoffset;		/* the initial vertical offset of the screen */
+static int nbufs = 1;		/* the number of buffers in the virtual screen */
+static int bufrows;		/* the number of rows in each buffer */
+static int front;		/* the buffer being displayed */
+static int vsync;		/* wait for vertical sync before panning */
+static int mem;			/* a memory framebuffer (FBMEM_ENV) */
 
 static int fb_len(void)
 {
@@ -84,8 +90,64 @@ static void init_colors(void)
 	bl = vinfo.blue.offset;
 }
 
+/* pixel layouts of memory framebuffers: xrgb8888, rgb888, rgb565, xrgb1555 */
+static void fbmem_layout(int bits)
+{
+	int b = bits == 15 || bits == 16 ? 5 : 8;
+	int g = bits == 16 ? 6 : b;
+	vinfo.bits_per_pixel = bits == 15 ? 16 : bits;
+	vinfo.blue.offset = 0;
+	vinfo.blue.length = b;
+	vinfo.green.offset = b;
+	vinfo.green.length = g;
+	vinfo.red.offset = b + g;
+	vinfo.red.length = b;
+}
+
+/*
+ * Use memory instead of the framebuffer device; spec is
+ * "colsxrows[xbits][:file]".  Without a file the memory is anonymous.
+ * The virtual screen is twice as tall as the screen, for fb_double().
+ */
+int fb_initmem(char *spec)
+{
+	char *path = strchr(spec, ':');
+	int cols, rows, bits = 32;
+	if (sscanf(spec, "%dx%dx%d", &cols, &rows, &bits) < 2 || cols <= 0 ||
+			rows <= 0 || (bits != 15 && bits != 16 && bits != 24 && bits != 32)) {
+		fprintf(stderr, "fb_init(): bad %s <%s>\n", FBMEM_ENV, spec);
+		return 1;
+	}
+	mem = 1;
+	vinfo.xres = vinfo.xres_virtual = cols;
+	vinfo.yres = rows;
+	vinfo.yres_virtual = rows * 2;
+	fbmem_layout(bits);
+	bpp = (vinfo.bits_per_pixel + 7) >> 3;
+	finfo.visual = FB_VISUAL_TRUECOLOR;
+	finfo.line_length = cols * bpp;
+	fd = path ? open(path + 1, O_RDWR | O_CREAT, 0600) : -1;
+	if (path && (fd == -1 || ftruncate(fd, fb_len()) == -1))
+		goto failed;
+	if (fd != -1)
+		fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+	fb = mmap(NULL, fb_len(), PROT_READ | PROT_WRITE,
+		fd != -1 ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS, fd, 0);
+	if (fb == MAP_FAILED)
+		goto failed;
+	init_colors();
+	return 0;
+failed:
+	perror("fb_init()");
+	if (fd != -1)
+		close(fd);
+	return 1;
+}
+
 int fb_init(void)
 {
+	if (getenv(FBMEM_ENV))
+		return fb_initmem(getenv(FBMEM_ENV));
 	fd = open(FBDEV_PATH, O_RDWR);
 	if (fd == -1)
 		goto failed;
@@ -98,6 +160,7 @@ int fb_init(void)
 	fb = mmap(NULL, fb_len(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 	if (fb == MAP_FAILED)
 		goto failed;
+	yoffset = vinfo.yoffset;
 	init_colors();
 	fb_cmap_save(1);
 	fb_cmap();
@@ -108,11 +171,70 @@ failed:
 	return 1;
 }
 
+static void fb_pan(int r)
+{
+	int zero = 0;
+	if (mem) {
+		vinfo.yoffset = r;
+		return;
+	}
+	if (vsync)
+		ioctl(fd, FBIO_WAITFORVSYNC, &zero);
+	vinfo.yoffset = r;
+	ioctl(fd, FBIOPAN_DISPLAY, &vinfo);
+}
+
+/*
+ * Use the virtual screen as two buffers, if it is tall enough: the
+ * back buffer is drawn while the front buffer is displayed.  Buffers
+ * taller than the screen allow scrolling by panning in fb_show().
+ */
+int fb_double(int wait)
+{
+	if (vinfo.yres_virtual < 2 * vinfo.yres)
+		return 1;
+	if (!mem && ioctl(fd, FBIOPAN_DISPLAY, &vinfo) == -1)
+		return 1;
+	nbufs = 2;
+	bufrows = vinfo.yres_virtual / 2;
+	front = 0;
+	vsync = wait;
+	fb_pan(0);
+	return 0;
+}
+
+/* the number of rows available for drawing */
+int fb_vrows(void)
+{
+	return nbufs > 1 ? bufrows : vinfo.yres;
+}
+
+/* display the back buffer from row r */
+void fb_flip(int r)
+{
+	if (nbufs < 2)
+		return;
+	front = 1 - front;
+	fb_pan(front * bufrows + r);
+}
+
+/* display the front buffer from row r */
+void fb_show(int r)
+{
+	if (nbufs > 1)
+		fb_pan(front * bufrows + r);
+}
+
 void fb_free(void)
 {
+	if (nbufs > 1) {
+		vsync = 0;
+		fb_pan(yoffset);
+	}
 	fb_cmap_save(0);
 	munmap(fb, fb_len());
-	close(fd);
+	if (fd != -1)
+		close(fd);
 }
 
 int fb_rows(void)
@@ -127,6 +249,8 @@ int fb_cols(void)
 
 void *fb_mem(int r)
 {
+	if (nbufs > 1)
+		return fb + ((1 - front) * bufrows + r) * finfo.line_length;
 	return fb + (r + vinfo.yoffset) * finfo.line_length;
 }
 
@@ -135,7 +259,56 @@ void fb_set(int r, int c, void *mem, int len)
 	memcpy(fb_mem(r) + (c + vinfo.xoffset) * bpp, mem, len * bpp);
 }
 
+/* copy n rows from row src of the displayed buffer to row dst */
+void fb_move(int dst, int src, int n)
+{
+	if (nbufs > 1)
+		memcpy(fb_mem(dst), fb + (front * bufrows + src) * finfo.line_length,
+			n * finfo.line_length);
+	else
+		memmove(fb_mem(dst), fb_mem(src), n * finfo.line_length);
+}
+
 unsigned fb_val(int r, int g, int b)
 {
 	return ((r >> rr) << rl) | ((g >> gr) << gl) | ((b >> br) << bl);
 }
+
+static int fb_comp(unsigned v, int off, int len)
+{
+	int c = (v >> off) & ((1 << len) - 1);
+	return len ? c * 255 / ((1 << len) - 1) : 0;
+}
+
+/* the 8-bit red, green and blue channels of framebuffer value v */
+void fb_rgb(unsigned v, unsigned char *rgb)
+{
+	rgb[0] = fb_comp(v, vinfo.red.offset, vinfo.red.length);
+	rgb[1] = fb_comp(v, vinfo.green.offset, vinfo.green.length);
+	rgb[2] = fb_comp(v, vinfo.blue.offset, vinfo.blue.length);
+}
+
+/* write the displayed screen as a PPM image */
+int fb_dump(char *path)
+{
+	FILE *fp = fopen(path, "w");
+	unsigned char *rgb, *src;
+	unsigned v;
+	int i, j, k;
+	if (!fp)
+		return 1;
+	rgb = malloc(vinfo.xres * 3);
+	fprintf(fp, "P6\n%d %d\n255\n", vinfo.xres, vinfo.yres);
+	for (i = 0; i < vinfo.yres && rgb; i++) {
+		src = fb + (vinfo.yoffset + i) * finfo.line_length +
+			vinfo.xoffset * bpp;
+		for (j = 0; j < vinfo.xres; j++) {
+			for (v = 0, k = 0; k < bpp; k++)
+				v |= src[j * bpp + k] << (k * 8);
+			fb_rgb(v, rgb + j * 3);
+		}
+		fwrite(rgb, 1, vinfo.xres * 3, fp);
+	}
+	free(rgb);
+	return fclose(fp) || !rgb;
+}
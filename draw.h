@@ -1,5 +1,7 @@
 /* framebuffer device */
 #define FBDEV_PATH	"/dev/fb0"
+/* use memory instead, if set to "colsxrows[xbits][:file]" */
+#define FBMEM_ENV	"FBPDF_FB"
 
 /* fb_mode() interpretation */
 #define FBM_BPP(m)	(((m) >> 16) & 0x0f)
@@ -7,13 +9,21 @@
 
 /* main functions */
 int fb_init(void);
+int fb_initmem(char *spec);
 void fb_free(void);
 unsigned fb_mode(void);
 void *fb_mem(int r);
 int fb_rows(void);
 int fb_cols(void);
 void fb_cmap(void);
+int fb_double(int vsync);
+int fb_vrows(void);
+void fb_flip(int r);
+void fb_show(int r);
+int fb_dump(char *path);
 
 /* helper functions */
 void fb_set(int r, int c, void *mem, int len);
+void fb_move(int dst, int src, int n);
 unsigned fb_val(int r, int g, int b);
+void fb_rgb(unsigned v, unsigned char *rgb);
@@ -0,0 +1,137 @@
+/*
+ * Rendering pages into image files
+ *
+ * Pages beg to end are rendered with doc_draw() and written as PPM
+ * images named after their page numbers.  Each worker thread renders
+ * with its own handle of the document and takes the next page not yet
+ * taken, so slow pages do not hold up the others.
+ */
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "draw.h"
+#include "doc.h"
+#include "export.h"
+
+#define MAXWORKERS	64
+
+struct worker {
+	struct doc *doc;
+	pthread_t thread;
+	int pages;		/* the number of pages written */
+	double secs;		/* the time spent in doc_draw() */
+};
+
+static int next, last;		/* the next page to render and the last one */
+static int failed;		/* the number of pages not written */
+static int zoom, rotate;
+static char *dir;
+static int digits;		/* the width of page numbers in file names */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int ppm_write(char *path, char *pbuf, int rows, int cols)
+{
+	unsigned char *rgb = malloc(cols * 3);
+	unsigned char *src;
+	FILE *fp;
+	fbval_t v;
+	int i, j, k;
+	if (!rgb || !(fp = fopen(path, "w"))) {
+		free(rgb);
+		return 1;
+	}
+	fprintf(fp, "P6\n%d %d\n255\n", cols, rows);
+	for (i = 0; i < rows; i++) {
+		for (j = 0; j < cols; j++) {
+			src = (unsigned char *) pbuf + (i * cols + j) * fbbpp;
+			for (v = 0, k = 0; k < fbbpp; k++)
+				v |= (fbval_t) src[k] << (k * 8);
+			fb_rgb(v, rgb + j * 3);
+		}
+		fwrite(rgb, 1, cols * 3, fp);
+	}
+	free(rgb);
+	return fclose(fp) != 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *work(void *arg)
+{
+	struct worker *w = arg;
+	char path[1024];
+	char *pbuf;
+	double t;
+	int p, rows, cols;
+	while (1) {
+		pthread_mutex_lock(&lock);
+		p = next <= last ? next++ : 0;
+		pthread_mutex_unlock(&lock);
+		if (!p)
+			break;
+		snprintf(path, sizeof(path), "%s/%0*d.ppm", dir, digits, p);
+		t = now();
+		pbuf = doc_draw(w->doc, p, zoom, rotate, &rows, &cols);
+		w->secs += now() - t;
+		if (pbuf && !ppm_write(path, pbuf, rows, cols)) {
+			w->pages++;
+		} else {
+			fprintf(stderr, "fbpdf: cannot export page %d\n", p);
+			pthread_mutex_lock(&lock);
+			failed++;
+			pthread_mutex_unlock(&lock);
+		}
+		free(pbuf);
+	}
+	return NULL;
+}
+
+/* render pages beg to end into dir with the given number of workers */
+int export_pages(struct doc *doc, int beg, int end, int _zoom, int _rotate,
+		char *_dir, int workers)
+{
+	struct worker ws[MAXWORKERS];
+	double t = now();
+	double secs = 0;
+	int n, i, pages = 0;
+	next = beg;
+	last = end;
+	failed = 0;
+	zoom = _zoom;
+	rotate = _rotate;
+	dir = _dir;
+	digits = snprintf(NULL, 0, "%d", doc_pages(doc));
+	mkdir(dir, 0755);
+	memset(ws, 0, sizeof(ws));
+	ws[0].doc = doc;
+	workers = workers < MAXWORKERS ? workers : MAXWORKERS;
+	for (n = 1; n < workers && n <= end - beg; n++) {
+		if (!(ws[n].doc = doc_clone(doc)))
+			break;
+		if (pthread_create(&ws[n].thread, NULL, work, &ws[n])) {
+			doc_close(ws[n].doc);
+			break;
+		}
+	}
+	work(&ws[0]);
+	for (i = 1; i < n; i++) {
+		pthread_join(ws[i].thread, NULL);
+		doc_close(ws[i].doc);
+	}
+	for (i = 0; i < n; i++) {
+		pages += ws[i].pages;
+		secs += ws[i].secs;
+	}
+	t = now() - t;
+	printf("fbpdf: %d pages in %.2f seconds, %.2f pages/s, %d workers, %.2f seconds rendering\n",
+		pages, t, t > 0 ? pages / t : 0, n, secs);
+	return failed > 0;
+}
@@ -0,0 +1,3 @@
+/* rendering pages into image files */
+int export_pages(struct doc *doc, int beg, int end, int zoom, int rotate,
+		char *dir, int workers);
@@ -16,7 +16,6 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <sys/ioctl.h>
-#include <linux/input.h>
 #include <ctype.h>
 #include <signal.h>
 #include <stdio.h>
@@ -24,11 +23,17 @@
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
-#include <pthread.h>
-#include <errno.h>
 #include "draw.h"
 #include "doc.h"
-#include "dev-input-mice/mouse.h"
+#include "render.h"
+#include "conv.h"
+#include "input.h"
+#include "disk.h"
+#include "session.h"
+#include "trace.h"
+#include "export.h"
+#include "search.h"
+#include "thumb.h"
 
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
 #define MAX(a, b)	((a) > (b) ? (a) : (b))
@@ -37,17 +42,46 @@
 #define MINZOOM		10
 #define MAXZOOM		100
 #define MARGIN		1
+#define WORKERS		2	/* threads rendering pages in background */
+#define TILE		256	/* the size of tiles of large pages */
+#define TILEPAGE	4	/* draw pages larger than this many screens in tiles */
+#define NPAGES		256	/* maximum number of pages loaded at once; a safety limit */
+#define NMARGIN		256	/* maximum number of tiles prefetched around the screen */
+#define THUMBCOLS	6	/* the number of thumbnails in each row of the overview */
+#define THUMBPAD	4	/* the space around thumbnails */
+#define THUMBMB		32	/* the memory used by thumbnails in megabytes */
+#define THUMBMS		50	/* how often the overview shows new thumbnails */
 #define CTRLKEY(x)	((x) - 96)
 #define ISMARK(x)	(isalpha(x) || (x) == '\'' || (x) == '`')
 
+/*
+ * The pages are placed one after another on a vertical canvas; page
+ * num, the page at the top of the screen, starts at row prow and the
+ * pages are centred on column zero.  The loaded pages cover the part
+ * of the canvas drawn on the framebuffer.
+ */
 static struct doc *doc;
-static fbval_t **pbufs;		/* current page(s) */
-static int np = 2;		/* maximum number of pages to load */
-static int lp;			/* actual number of pages to load */
+static struct winpage {
+	int page;		/* page number; zero if not loaded */
+	int zoom, rotate;
+	int row;		/* the first row of the page relative to prow */
+	int rows, cols;		/* page dimensions */
+	char *pbuf;		/* rendered page; NULL if drawn in tiles or cancelled */
+	int tiled;		/* is the page drawn in tiles? */
+} win[NPAGES];			/* loaded pages */
+static int lp;			/* the number of loaded pages */
 static int srows, scols;	/* screen dimentions */
 static int prows, pcols;	/* current page dimensions */
 static int prow, pcol;		/* page position */
 static int srow, scol;		/* screen position */
+static int dir = 1;		/* the direction of the last page change */
+static struct pageidx {
+	int zoom, rotate;	/* the zoom and rotation of rows and cols; zero zoom if unknown */
+	int rows, cols;		/* page dimensions */
+	int bbox_rotate;	/* the rotation of bbox plus one; zero if unknown */
+	int bbox[4];		/* the contents of the page in BBOX_UNIT */
+} *pidx;			/* page geometry indexed by page number */
+static int npidx;		/* the size of pidx[] */
 
 static struct termios termios;
 static char filename[256];
@@ -60,95 +94,412 @@ static int zoom_def = 15;	/* default zoom */
 static int rotate;
 static int count;
 static int invert;		/* invert colors? */
+static int color;		/* colour mode: CONV_NIGHT, CONV_SEPIA or zero */
+static int gamma10 = 10;	/* gamma x10 */
 static int toggleinfo = 1;	/* print info? */
+static long cache_mb = 64;	/* rendered page cache size in megabytes */
+static long disk_mb;		/* on-disk page cache size in megabytes */
+static int threads = 1;		/* the number of threads rendering each page */
+static char *tracefile;		/* the trace file given with -T */
+static char *xrange;		/* the pages to export with -x */
+static char *xdir = ".";	/* the directory of exported pages */
+static int xjobs;		/* the number of exporting threads */
+static int resume;		/* the page of the saved session; zero if none */
+static int resume_row, resume_col, resume_zoom;	/* its screen position */
 
-static void draw(void)
+static char **tiles;		/* the tiles of the current row of tiles */
+static int tiles_n;		/* the number of tiles in tiles[] */
+static int tiles_page, tiles_row, tiles_col;	/* the position of tiles[] */
+static char *rbuf;		/* a screen row */
+static int drawn;		/* does the framebuffer show the loaded pages? */
+static int drawn_srow, drawn_scol;	/* screen position of the last draw() */
+static int fbase;		/* the page row shown in the first framebuffer row */
+static int dbuf;		/* double buffering (2 to wait for vsync) */
+static int redraw;		/* should the screen be updated once input is drained? */
+static int merged;		/* commands folded into a later redraw */
+static char pattern[128];	/* the search pattern */
+static int spage, soff;		/* the page and the text offset of the last match */
+static int thumb_rotate = -1;	/* the rotation of thumbnails; -1 if not started */
+
+static void tiles_free(void)
 {
-	int i, j;
-	fbval_t *rbuf = malloc(scols * sizeof(rbuf[0]));
-	for (i = srow; i < srow + srows; i++) {
-		int cbeg = MAX(scol, pcol);
-		int cend = MIN(scol + scols, pcol + pcols);
-		memset(rbuf, 0, scols * sizeof(rbuf[0]));
-		for (j = 0; j < lp; j++) {	/* lp must be already updated by loadpage */
-			if (i >= prow + prows * j && i < prow + prows * (j+1) && cbeg < cend) {
-				memcpy(rbuf + cbeg - scol,
-					pbufs[j] + (i - prow - prows * j) * pcols + cbeg - pcol,
-					(cend - cbeg) * sizeof(rbuf[0]));
+	int i;
+	for (i = 0; i < tiles_n; i++)
+		if (tiles[i])
+			render_untile(tiles[i]);
+	tiles_n = 0;
+}
+
+/* the tile of page w at row ty and column tx */
+static char *tile(struct winpage *w, int ty, int tx)
+{
+	return render_tile(w->page, zoom, rotate, tx * TILE, ty * TILE,
+			MIN(TILE, w->cols - tx * TILE), MIN(TILE, w->rows - ty * TILE));
+}
+
+/* copy columns c0 to c1 of row r of page w, which is drawn in tiles */
+static void tiles_copy(char *dst, struct winpage *w, int r, int c0, int c1)
+{
+	int ty = r / TILE;
+	int tx;
+	if (!tiles_n || w->page != tiles_page || ty != tiles_row) {
+		tiles_free();
+		tiles_page = w->page;
+		tiles_row = ty;
+		tiles_col = c0 / TILE;
+		for (tx = tiles_col; tx <= (c1 - 1) / TILE; tx++)
+			tiles[tiles_n++] = tile(w, ty, tx);
+	}
+	for (tx = c0 / TILE; tx <= (c1 - 1) / TILE; tx++) {
+		char *t = tiles[tx - tiles_col];
+		int beg = MAX(c0, tx * TILE);
+		int end = MIN(c1, tx * TILE + TILE);
+		int tw = MIN(TILE, w->cols - tx * TILE);
+		if (t)
+			memcpy(dst + (beg - c0) * fbbpp,
+				t + ((r - ty * TILE) * tw + beg - tx * TILE) * fbbpp,
+				(end - beg) * fbbpp);
+	}
+}
+
+/* let the workers render the tiles around the screen to make scrolling faster */
+static void tiles_margin(void)
+{
+	struct tilepos tp[NMARGIN];
+	int n = 0;
+	int j, ty, tx;
+	for (j = 0; j < lp; j++) {
+		struct winpage *w = &win[j];
+		int top = prow + w->row;
+		int left = -w->cols / 2;
+		int r0 = MAX(0, srow - top - TILE);
+		int r1 = MIN(w->rows, srow - top + srows + TILE);
+		int c0 = MAX(0, scol - left - TILE);
+		int c1 = MIN(w->cols, scol - left + scols + TILE);
+		if (!w->tiled)
+			continue;
+		for (ty = r0 / TILE; ty * TILE < r1; ty++) {
+			for (tx = c0 / TILE; tx * TILE < c1 && n < NMARGIN; tx++) {
+				tp[n].page = w->page;
+				tp[n].x = tx * TILE;
+				tp[n].y = ty * TILE;
+				tp[n].w = MIN(TILE, w->cols - tx * TILE);
+				tp[n].h = MIN(TILE, w->rows - ty * TILE);
+				n++;
 			}
 		}
-		fb_set(i - srow, 0, rbuf, scols);
 	}
-	free(rbuf);
+	render_tiles(tp, n, zoom, rotate);
 }
 
-static int loadpage(int p)
+/* the first screen row covered by the status line */
+static int infotop(void)
+{
+	struct winsize w;
+	if (!toggleinfo || ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) || w.ws_row < 1)
+		return srows;
+	return srows / w.ws_row * (w.ws_row - 1);
+}
+
+/* draw rows r0 to r1 of the framebuffer, whose first row shows page row fbase */
+static void draw_rows(int r0, int r1)
 {
+	long t;
 	int i, j;
-	int xp;		/* number of pages to be loaded that exceeds number of pages of document */
-	int dp;		/* number of pages changed wrt page number */
-	if (p < 1 || p > doc_pages(doc))
+	for (i = fbase + r0; i < fbase + r1; i++) {
+		memset(rbuf, 0, scols * fbbpp);
+		for (j = 0; j < lp; j++) {
+			struct winpage *w = &win[j];
+			int top = prow + w->row;
+			int left = -w->cols / 2;
+			int cbeg = MAX(scol, left);
+			int cend = MIN(scol + scols, left + w->cols);
+			if (i < top || i >= top + w->rows || cbeg >= cend)
+				continue;
+			if (w->pbuf)
+				memcpy(rbuf + (cbeg - scol) * fbbpp,
+					w->pbuf + ((i - top) * w->cols + cbeg - left) * fbbpp,
+					(cend - cbeg) * fbbpp);
+			else if (w->tiled)
+				tiles_copy(rbuf + (cbeg - scol) * fbbpp, w,
+					i - top, cbeg - left, cend - left);
+			t = trace_now();
+			conv_apply(rbuf + (cbeg - scol) * fbbpp, cend - cbeg);
+			trace_lap(TR_FILTER, t);
+		}
+		fb_set(i - fbase, 0, rbuf, scols);
+	}
+	tiles_free();
+}
+
+/*
+ * Update the framebuffer.  The framebuffer may have more rows than
+ * the screen (fb_vrows()), in which case scrolling within them only
+ * pans the display.  Otherwise, the rows still valid are moved within
+ * the framebuffer and only the exposed rows are drawn.  The rows under
+ * the status line are never moved, since the console draws over them.
+ */
+static void draw(void)
+{
+	int vrows = fb_vrows();
+	int top = dbuf ? vrows : infotop();
+	int base = srow - (vrows - srows) / 2;
+	int d = base - fbase;
+	int r0 = MAX(0, -d);
+	int r1 = MIN(vrows, top - d);
+	if (drawn && scol == drawn_scol && srow >= fbase &&
+			srow + srows <= fbase + vrows) {
+		if (srow != drawn_srow)
+			fb_show(srow - fbase);
+		drawn_srow = srow;
+		return;
+	}
+	fbase = base;
+	if (drawn && scol == drawn_scol && r0 < r1) {
+		fb_move(r0, r0 + d, r1 - r0);
+		draw_rows(0, r0);
+		draw_rows(r1, vrows);
+	} else {
+		draw_rows(0, vrows);
+	}
+	fb_flip(srow - fbase);
+	drawn = 1;
+	drawn_srow = srow;
+	drawn_scol = scol;
+	tiles_margin();
+}
+
+/* the index entry of page p */
+static struct pageidx *pageidx(int p)
+{
+	struct pageidx *pi;
+	if (p >= npidx) {
+		int n = MAX(p + 1, npidx * 2);
+		if (!(pi = realloc(pidx, n * sizeof(pidx[0]))))
+			return NULL;
+		memset(pi + npidx, 0, (n - npidx) * sizeof(pidx[0]));
+		pidx = pi;
+		npidx = n;
+	}
+	return &pidx[p];
+}
+
+/* the dimensions of page p, from its bounds if it is not rendered */
+static int pagesize(int p, int *rows, int *cols)
+{
+	struct pageidx *pi = pageidx(p);
+	if (pi && pi->zoom == zoom && pi->rotate == rotate) {
+		*rows = pi->rows;
+		*cols = pi->cols;
+		return 0;
+	}
+	if (doc_size(doc, p, zoom, rotate, rows, cols))
 		return 1;
-	lp = np;
-	xp = (p + np - 1) - doc_pages(doc);
-	if (xp > 0)
-		lp -= xp;	/* if any excess pages, then do not load this excess number of pages */
-	dp = p - num;
-	prows = 0;
-	/*
-	 * Free off-screen pages.
-	 * Copy existing pages.
-	 * Draw new pages.
-	 */
-	if (dp > 0) {
-		for (j = 0; j < MIN(lp, dp); j++)
-			free(pbufs[j]);
-		for (j = 0; j < lp - dp; j++)
-			pbufs[j] = pbufs[j + dp];
-		for (j = MAX(0, lp - dp); j < lp; j++) {
-			pbufs[j] = doc_draw(doc, p+j, zoom, rotate, &prows, &pcols);
-			if (invert)
-				for (i = 0; i < prows * pcols; i++)
-					pbufs[j][i] = pbufs[j][i] ^ 0xffffffff;
+	if (pi) {
+		pi->zoom = zoom;
+		pi->rotate = rotate;
+		pi->rows = *rows;
+		pi->cols = *cols;
+	}
+	return 0;
+}
+
+/* is p a page of the document?  Until the pages are counted, ask the backend */
+static int validpage(int p)
+{
+	int n = render_pages();
+	int rows, cols;
+	if (p < 1)
+		return 0;
+	return n < 0 ? !pagesize(p, &rows, &cols) : p <= n;
+}
+
+/* the loaded page p or NULL */
+static struct winpage *winfind(int p)
+{
+	int j;
+	for (j = 0; j < lp; j++)
+		if (win[j].page == p)
+			return &win[j];
+	return NULL;
+}
+
+/*
+ * Render page w, unless it is so large that it should be drawn in
+ * tiles.  The page size is known even if its rendering is cancelled.
+ */
+static void winload(struct winpage *w)
+{
+	struct pageidx *pi;
+	w->tiled = (long) w->rows * w->cols > (long) TILEPAGE * srows * scols;
+	if (w->tiled || !(w->pbuf = render_page(w->page, zoom, rotate, &w->rows, &w->cols)))
+		return;
+	if ((pi = pageidx(w->page)) && pi->zoom == zoom && pi->rotate == rotate) {
+		pi->rows = w->rows;
+		pi->cols = w->cols;
+	}
+}
+
+/* let the workers render the pages likely to be shown next */
+static void prefetch(void)
+{
+	struct winpage *w = winfind(num);
+	int first = lp ? win[0].page : num;
+	int last = lp ? win[lp - 1].page : num;
+	int next[3], pages[3];
+	int i, n = 0;
+	next[0] = dir > 0 ? last + 1 : first - 1;
+	next[1] = dir > 0 ? last + 2 : first - 2;
+	next[2] = dir > 0 ? first - 1 : last + 1;
+	for (i = 0; i < 3 && w && w->pbuf; i++)
+		if (validpage(next[i]))
+			pages[n++] = next[i];
+	render_want(pages, n, zoom, rotate);
+}
+
+/*
+ * Load the pages drawn on the framebuffer.  Pages already loaded are
+ * kept; only the newly exposed pages are rendered, the current page
+ * first.  Pages whose rendering was cancelled are rendered again.
+ */
+static void fill(void)
+{
+	struct winpage old[NPAGES];
+	long t = trace_now();
+	int vrows = fb_vrows();
+	int r0 = srow - (vrows - srows) / 2;
+	int r1 = r0 + vrows;
+	int first = num, top = 0;
+	int rows, cols;
+	int i, j, k;
+	while (top > r0 - prow && num - first < NPAGES / 2 &&
+			validpage(first - 1) && !pagesize(first - 1, &rows, &cols)) {
+		first--;
+		top -= rows;
+	}
+	memcpy(old, win, sizeof(old));
+	memset(win, 0, sizeof(win));
+	lp = 0;
+	for (i = first; lp < NPAGES && (i <= num || top < r1 - prow) && validpage(i); i++) {
+		struct winpage *w = &win[lp++];
+		for (k = 0; k < NPAGES; k++) {
+			if (old[k].page == i && old[k].zoom == zoom && old[k].rotate == rotate) {
+				*w = old[k];
+				memset(&old[k], 0, sizeof(old[k]));
+				break;
+			}
 		}
-	} else if (dp < 0) {
-		for (j = MAX(0, lp + dp); j < lp; j++)
-			free(pbufs[j]);
-		for (j = lp + dp - 1; j >= 0; j--)
-			pbufs[j - dp] = pbufs[j];
-		for (j = 0; j < MIN(lp, -dp); j++) {
-			pbufs[j] = doc_draw(doc, p+j, zoom, rotate, &prows, &pcols);
-			if (invert)
-				for (i = 0; i < prows * pcols; i++)
-					pbufs[j][i] = pbufs[j][i] ^ 0xffffffff;
+		w->page = i;
+		w->zoom = zoom;
+		w->rotate = rotate;
+		w->row = top;
+		if (!w->pbuf && !w->tiled && pagesize(i, &w->rows, &w->cols))
+			w->rows = w->cols = 0;
+		top += w->rows;
+	}
+	for (k = 0; k < NPAGES; k++)
+		render_release(old[k].pbuf);
+	for (j = 0; j < 2; j++) {	/* the current page and the ones after it first */
+		for (i = 0; i < lp; i++) {
+			struct winpage *w = &win[i];
+			if ((w->page >= num) != !j || w->pbuf || w->tiled)
+				continue;
+			winload(w);
+			if (w->pbuf && prow + w->row < fbase + vrows &&
+					prow + w->row + w->rows > fbase)
+				drawn = 0;	/* it was drawn blank */
 		}
-	} else {
-		for (j = 0; j < lp; j++) {
-			pbufs[j] = doc_draw(doc, p+j, zoom, rotate, &prows, &pcols);
-			if (invert)
-				for (i = 0; i < prows * pcols; i++)
-					pbufs[j][i] = pbufs[j][i] ^ 0xffffffff;
+	}
+	top = 0;		/* rendered pages may differ from their bounds */
+	for (i = 0; i < lp && win[i].page < num; i++)
+		top -= win[i].rows;
+	for (i = 0; i < lp; i++) {
+		win[i].row = top;
+		top += win[i].rows;
+		if (win[i].page == num) {
+			prows = win[i].rows;
+			pcols = win[i].cols;
+			pcol = -pcols / 2;
 		}
 	}
+	trace_lap(TR_LOAD, t);
+	prefetch();
+}
+
+/* release the loaded pages */
+static void winfree(void)
+{
+	int j;
+	for (j = 0; j < NPAGES; j++)
+		render_release(win[j].pbuf);
+	memset(win, 0, sizeof(win));
+	lp = 0;
+}
+
+/* move to page p; the pages are loaded by fill() */
+static int loadpage(int p)
+{
+	if (!validpage(p))
+		return 1;
+	if (p != num)
+		dir = p > num ? 1 : -1;
+	num = p;
+	if (pagesize(p, &prows, &pcols))
+		prows = pcols = 0;
 	prow = -prows / 2;
 	pcol = -pcols / 2;
-	num = p;
+	drawn = 0;
 	return 0;
 }
 
+/*
+ * Make num the page at the top of the screen, so scrolling moves over
+ * the canvas without reloading the pages, and keep the screen on it.
+ */
+static void settle(void)
+{
+	int rows, cols;
+	while (srow >= prow + prows && validpage(num + 1) && !pagesize(num + 1, &rows, &cols)) {
+		prow += prows;
+		prows = rows;
+		pcols = cols;
+		num++;
+		dir = 1;
+	}
+	while (srow < prow && validpage(num - 1) && !pagesize(num - 1, &rows, &cols)) {
+		prow -= rows;
+		prows = rows;
+		pcols = cols;
+		num--;
+		dir = -1;
+	}
+	pcol = -pcols / 2;
+	srow = MAX(prow - srows + MARGIN, MIN(prow + prows - MARGIN, srow));
+	scol = MAX(pcol - scols + MARGIN, MIN(pcol + pcols - MARGIN, scol));
+	fill();
+}
+
+/* colour transforms are applied when drawing; the pages are not rendered again */
+static void recolor(void)
+{
+	conv_filter(color, invert, gamma10);
+	drawn = 0;
+}
+
 static void zoom_page(int z)
 {
 	int _zoom = MAX(MINZOOM, zoom);
+	int off = srow - prow;
 	zoom = MIN(MAXZOOM, MAX(1, z));
 	if (!loadpage(num))
-		srow = srow * zoom / _zoom;
+		srow = prow + off * zoom / _zoom;
 }
 
 static void setmark(int c)
 {
 	if (ISMARK(c)) {
 		mark[c] = num;
-		mark_row[c] = srow / zoom;
+		mark_row[c] = (srow - prow) / zoom;
 	}
 }
 
@@ -158,16 +509,63 @@ static void jmpmark(int c)
 		int dst = mark[c];
 		setmark('\'');
 		if (!loadpage(dst))
-			srow = mark_row[c] * zoom;
+			srow = prow + mark_row[c] * zoom;
+	}
+}
+
+/* restore the state of the document saved by state_save() */
+static void state_load(void)
+{
+	char path[1024];
+	char key[32];
+	unsigned char c;
+	int n, r, g;
+	FILE *fp;
+	if (session_path(filename, path, sizeof(path)) || !(fp = fopen(path, "r")))
+		return;
+	while (fscanf(fp, "%31s", key) == 1) {
+		if (!strcmp(key, "page") && fscanf(fp, "%d %d %d %d",
+				&resume, &resume_row, &resume_col, &resume_zoom) == 4 &&
+				resume >= 1)
+			num = resume;
+		if (!strcmp(key, "zoom") && fscanf(fp, "%d", &n) == 1)
+			zoom = MIN(MAXZOOM, MAX(1, n));
+		if (!strcmp(key, "rotate") && fscanf(fp, "%d", &n) == 1)
+			rotate = (n / 90 % 4 + 4) % 4 * 90;
+		if (!strcmp(key, "color") && fscanf(fp, "%d %d %d", &n, &r, &g) == 3) {
+			color = (n % 3 + 3) % 3;
+			invert = r != 0;
+			gamma10 = MIN(50, MAX(1, g));
+		}
+		if (!strcmp(key, "mark") && fscanf(fp, " %c %d %d", &c, &n, &r) == 3 &&
+				c < 128 && ISMARK(c)) {
+			mark[c] = n;
+			mark_row[c] = r;
+		}
 	}
+	fclose(fp);
 }
 
-static unsigned char readkey(void)
+/* save the page, position, zoom, rotation, colours and marks */
+static void state_save(void)
 {
-	unsigned char b;
-	if (read(0, &b, 1) <= 0)
-		return -1;
-	return b;
+	char path[1024], tmp[1032];
+	FILE *fp;
+	int i;
+	if (session_path(filename, path, sizeof(path)))
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (!(fp = fopen(tmp, "w")))
+		return;
+	fprintf(fp, "page %d %d %d %d\n", num, srow - prow, scol, zoom);
+	fprintf(fp, "zoom %d\n", zoom);
+	fprintf(fp, "rotate %d\n", rotate);
+	fprintf(fp, "color %d %d %d\n", color, invert, gamma10);
+	for (i = 0; i < 128; i++)
+		if (ISMARK(i) && mark[i])
+			fprintf(fp, "mark %c %d %d\n", i, mark[i], mark_row[i]);
+	if (fclose(fp) || rename(tmp, path))
+		remove(tmp);
 }
 
 static int getcount(int def)
@@ -180,15 +578,66 @@ static int getcount(int def)
 static void printinfo(void)
 {
 	int length;
-	struct winsize w;
+	int hits, misses;
+	long last, avg, p99;
+	char cache[128] = "";
+	char pages[16] = "?";
+	struct winsize w = {0};
 	ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-	length = w.ws_col - 43;		/* assume page number under 1000, zoom number under 1000% */
+	if (trace_enabled()) {	/* the counters are shown while tracing */
+		render_stats(&hits, &misses);
+		trace_stats(&last, &avg, &p99);
+		snprintf(cache, sizeof(cache), "  hit:%d miss:%d merged:%d  ms:%.1f/%.1f/%.1f",
+			hits, misses, merged, last / 1000., avg / 1000., p99 / 1000.);
+	}
+	if (render_pages() >= 0)
+		snprintf(pages, sizeof(pages), "%d", render_pages());
+	length = MAX(0, w.ws_col - 43 - (int) strlen(cache));	/* assume page number under 1000, zoom number under 1000% */
 	printf("\x1b[%d;%dH", srows, 0);
-	printf("FBPDF:     file:%*.*s  page:%d(%d)  zoom:%d%% \x1b[K\r",
-		length, length, filename, num, doc_pages(doc), zoom * 10);
+	printf("FBPDF:     file:%*.*s  page:%d(%s)  zoom:%d%%%s \x1b[K\r",
+		length, length, filename, num, pages, zoom * 10, cache);
 	fflush(stdout);
 }
 
+/* update the screen; this ends the frame of the commands since the last update */
+static void update(void)
+{
+	long t = trace_now();
+	draw();
+	trace_lap(TR_DRAW, t);
+	trace_end(num, zoom);
+	if (toggleinfo)
+		printinfo();
+}
+
+/* load the pages whose renders were cancelled */
+static void refill(void)
+{
+	render_resume();
+	fill();
+	drawn = 0;
+	redraw = 1;
+}
+
+/*
+ * Read the next key.  The screen is updated only when no input is
+ * pending, so a burst of commands, like a fast wheel spin, results in
+ * one redraw of their net movement.  Renders are cancelled while there
+ * is input; once it is drained, the pages cancelled are loaded again.
+ */
+static int nextkey(void)
+{
+	if (!input_wait(0)) {
+		if (render_cancelled())
+			refill();
+		if (redraw && !render_cancelled()) {
+			update();
+			redraw = 0;
+		}
+	}
+	return input_key();
+}
+
 static void term_setup(void)
 {
 	struct termios newtermios;
@@ -211,150 +660,368 @@ static void term_cleanup(void)
 static void sigcont(int sig)
 {
 	term_setup();
+	drawn = 0;
 }
 
-static int reload(void)
+/* print msg in the status line */
+static void message(char *msg)
 {
-	doc_close(doc);
-	doc = doc_open(filename);
-	if (!doc || !doc_pages(doc)) {
-		fprintf(stderr, "\nfbpdf: cannot open <%s>\n", filename);
-		return 1;
-	}
-	if (!loadpage(num))
-		draw();
-	return 0;
+	printf("\x1b[%d;%dH%s\x1b[K", srows, 0, msg);
+	fflush(stdout);
 }
 
-static int rmargin(void)
+/* read a line in the status line; returns nonzero if cancelled */
+static int readline(char *prompt, char *buf, int len)
 {
-	int ret = 0;
-	int i, j;
-	for (i = 0; i < prows; i++) {
-		j = pcols - 1;
-		while (j > ret && pbufs[0][i * pcols + j] == FB_VAL(255, 255, 255))
-			j--;
-		if (ret < j)
-			ret = j;
+	char line[256];
+	int n = 0;
+	int c;
+	buf[0] = '\0';
+	while (1) {
+		snprintf(line, sizeof(line), "%s%s", prompt, buf);
+		message(line);
+		c = input_key();
+		if (c == '\n' || c == '\r')
+			return 0;
+		if (c == 27 || c == -1)
+			return 1;
+		if ((c == 127 || c == CTRLKEY('h')) && n > 0)
+			buf[--n] = '\0';
+		if (c >= ' ' && c < 256 && c != 127 && n + 1 < len) {
+			buf[n++] = c;
+			buf[n] = '\0';
+		}
 	}
-	return ret;
 }
 
-static int lmargin(void)
+/* show the next match of the pattern after (dir > 0) or before the last one */
+static int search(int dir)
 {
-	int ret = pcols;
-	int i, j;
-	for (i = 0; i < prows; i++) {
-		j = 0;
-		while (j < ret && pbufs[0][i * pcols + j] == FB_VAL(255, 255, 255))
-			j++;
-		if (ret > j)
-			ret = j;
+	int p = spage, off = soff;
+	int x, y, r;
+	if (render_cancelled())	/* pages are extracted with the main handle too */
+		refill();
+	if (p != num) {		/* start from the current page */
+		p = num;
+		off = dir > 0 ? -1 : 1 << 30;
 	}
-	return ret;
+	if (search_find(pattern, dir, &p, &off, &x, &y)) {
+		message("FBPDF: pattern not found");
+		return 1;
+	}
+	spage = p;
+	soff = off;
+	setmark('\'');
+	if (!loadpage(p)) {
+		r = (rotate / 90) % 4;
+		r = r == 0 ? y : (r == 1 ? x : BBOX_UNIT - (r == 2 ? y : x));
+		srow = prow + r * prows / BBOX_UNIT - srows / PAGESTEPS;
+	}
+	return 0;
 }
 
-static void safe_pipe(int p[2])
+/* fill n pixels of dst with v */
+static void fbfill(char *dst, fbval_t v, int n)
 {
-	if (pipe(p)) {
-		fprintf(stderr, "Pipe failed\n");
-		exit(EXIT_FAILURE);
+	int i;
+	for (i = 0; i < n; i++)
+		memcpy(dst + i * fbbpp, &v, fbbpp);
+}
+
+/* draw the overview from page first, with a frame around the thumbnail of page cur */
+static void overview_draw(int first, int cur, int cw, int ch, int nrows)
+{
+	fbval_t frame = FB_VAL(255, 160, 0);
+	fbval_t blank = FB_VAL(64, 64, 64);
+	char *pbufs[THUMBCOLS];
+	int rows[THUMBCOLS], cols[THUMBCOLS];
+	int valid[THUMBCOLS];
+	int bw = cw - 2 * THUMBPAD;
+	int bh = ch - 2 * THUMBPAD;
+	int top = infotop();
+	int i, j, r, x, y, w, h;
+	for (i = 0; i < top; i++) {
+		int p0 = first + i / ch * THUMBCOLS;
+		r = i % ch;
+		for (j = 0; j < THUMBCOLS && r == 0; j++) {	/* the thumbnails of this row */
+			valid[j] = i / ch < nrows && validpage(p0 + j);
+			pbufs[j] = valid[j] ? thumb_get(p0 + j, &rows[j], &cols[j]) : NULL;
+		}
+		memset(rbuf, 0, scols * fbbpp);
+		for (j = 0; j < THUMBCOLS && i / ch < nrows; j++) {
+			char *dst = rbuf + j * cw * fbbpp;
+			if (p0 + j == cur && (r < 2 || r >= ch - 2)) {
+				fbfill(dst, frame, cw);
+			} else if (p0 + j == cur) {
+				fbfill(dst, frame, 2);
+				fbfill(dst + (cw - 2) * fbbpp, frame, 2);
+			}
+			if (!valid[j] || r < THUMBPAD || r >= ch - THUMBPAD)
+				continue;
+			if (!pbufs[j]) {
+				fbfill(dst + THUMBPAD * fbbpp, blank, bw);
+				continue;
+			}
+			w = MIN(bw, cols[j]);
+			h = MIN(bh, rows[j]);
+			x = THUMBPAD + (bw - w) / 2;
+			y = r - THUMBPAD - (bh - h) / 2;
+			if (y >= 0 && y < h) {
+				memcpy(dst + x * fbbpp, pbufs[j] + y * cols[j] * fbbpp, w * fbbpp);
+				conv_apply(dst + x * fbbpp, w);
+			}
+		}
+		fb_set(i, 0, rbuf, scols);
 	}
+	fb_flip(0);
 }
 
-static void safe_dup2(int fildes, int fildes2)
+/*
+ * Show the thumbnails of the pages, rendered in the background, and
+ * let the user choose a page.  Return the page chosen, or zero.
+ */
+static int overview(void)
 {
-	if (dup2(fildes, fildes2) == -1) {
-		fprintf(stderr, "Dup failed\n");
-		exit(EXIT_FAILURE);
+	int cw = scols / THUMBCOLS;
+	int nrows = MAX(1, infotop() / (cw * 4 / 3));
+	int ch = infotop() / nrows;
+	int n = nrows * THUMBCOLS;
+	int cur = num, first = 0;
+	int done = -1, moved = 1;
+	int c, p, dx, dy;
+	char msg[64];
+	if (thumb_rotate != rotate) {
+		thumb_free();
+		thumb_init(doc, ch - 2 * THUMBPAD, cw - 2 * THUMBPAD, rotate, THUMBMB << 20);
+		thumb_rotate = rotate;
+	}
+	while (1) {
+		if (!first || cur < first || cur >= first + n) {
+			first = cur < first || !first ? (cur - 1) / THUMBCOLS * THUMBCOLS + 1 :
+				((cur - 1) / THUMBCOLS - nrows + 1) * THUMBCOLS + 1;
+			thumb_want(first, first + n - 1);
+		}
+		if (moved || thumb_done() != done) {
+			done = thumb_done();
+			overview_draw(first, cur, cw, ch, nrows);
+			snprintf(msg, sizeof(msg), "FBPDF: page %d", cur);
+			message(msg);
+			moved = 0;
+		}
+		if (!input_wait(THUMBMS) && !input_eof())
+			continue;
+		if ((c = input_key()) == 27 && input_wait(0)) {	/* terminal input sequence */
+			input_key();
+			c = input_key();
+			c = c == 'A' ? 'k' : (c == 'B' ? 'j' : (c == 'C' ? 'l' : (c == 'D' ? 'h' : c)));
+		}
+		if (c < 256 && isdigit(c)) {
+			count = count * 10 + c - '0';
+			continue;
+		}
+		p = 0;
+		switch (c) {
+		case INPUT_DRAG:	/* not to pan the page later */
+			input_drag(&dx, &dy);
+			break;
+		case -1:
+		case 27:
+		case 'q':
+		case 'v':
+			count = 0;
+			return 0;
+		case '\n':
+		case '\r':
+			count = 0;
+			return cur;
+		case 'h':
+			p = cur - getcount(1);
+			break;
+		case 'l':
+			p = cur + getcount(1);
+			break;
+		case 'k':
+			p = cur - THUMBCOLS * getcount(1);
+			break;
+		case 'j':
+			p = cur + THUMBCOLS * getcount(1);
+			break;
+		case 'u':
+		case 127:
+		case CTRLKEY('u'):
+			p = cur - n * getcount(1);
+			break;
+		case 'd':
+		case ' ':
+		case CTRLKEY('d'):
+			p = cur + n * getcount(1);
+			break;
+		case 'g':
+			p = getcount(1);
+			break;
+		case 'G':
+			p = getcount(render_pages());
+			break;
+		}
+		if (p > cur && !validpage(p) && render_pages() > 0)
+			p = render_pages();
+		if (p > 0 && validpage(p)) {
+			cur = p;
+			moved = 1;
+		}
 	}
 }
 
-static void safe_pthread_create(pthread_t *restrict thread, const pthread_attr_t *restrict attr, void *(*start_routine)(void*), void *restrict arg)
+/* open the document; without the size of its first page, it cannot be shown */
+static struct doc *docopen(char *path)
 {
-	if (pthread_create(thread, attr, start_routine, arg) == -1) {
-		fprintf(stderr, "Pthread failed\n");
-		exit(EXIT_FAILURE);
+	struct doc *doc = doc_open(path);
+	int rows, cols;
+	if (doc && doc_size(doc, 1, 10, 0, &rows, &cols)) {
+		doc_close(doc);
+		return NULL;
 	}
+	return doc;
 }
 
-static long safe_strtol(const char *restrict str, char **restrict endptr, int base)
+static int reload(void)
 {
-	long res = strtol(str, endptr, base);
-	if (str == *endptr) {
-		fprintf(stderr, "No digits found\n");
-		exit(EXIT_FAILURE);
+	search_free();
+	thumb_free();
+	thumb_rotate = -1;
+	render_free();
+	doc_close(doc);
+	doc = docopen(filename);
+	if (!doc) {
+		fprintf(stderr, "\nfbpdf: cannot open <%s>\n", filename);
+		return 1;
 	}
-	if (res == 0 && errno != 0) {
-		fprintf(stderr, "Wrong escape code\n");
-		exit(EXIT_FAILURE);
+	doc_threads(doc, threads);
+	disk_init(filename, disk_mb << 20);
+	render_init(doc, WORKERS, cache_mb << 20);
+	search_init(doc, filename);
+	spage = 0;
+	winfree();
+	free(pidx);
+	pidx = NULL;
+	npidx = 0;
+	if (!loadpage(num)) {
+		settle();
+		draw();
 	}
-	return res;
+	return 0;
 }
 
-static void *mouse_loop(void *arg)
+/* is pixel c of row r of page w white? */
+static int iswhite(struct winpage *w, int r, int c)
 {
-	int mouse_f;
-	struct packet p;
-	char *s = malloc(14*sizeof(char));
-	mouse_f = safe_open_mousefile();
-	init_mouse(mouse_f);
-	while (1) {
-		safe_read(mouse_f, &p, sizeof(p));
-		if (p.m) {
-			sprintf(s, "\x1b[m%d;%df", p.x, p.y);
-			safe_write(STDOUT_FILENO, s, strlen(s));
-		}
-		if (p.b)
-			safe_write(STDOUT_FILENO, "K", 1);
-		if (p.f)
-			safe_write(STDOUT_FILENO, "J", 1);
-		switch (p.z) {
-		case 1:
-			safe_write(STDOUT_FILENO, "j", 1);
-			break;
-		case 0xF:
-			safe_write(STDOUT_FILENO, "k", 1);
-			break;
-		default:
-			break;
-		}
-	}
-	safe_close(mouse_f);
-	free(s);
-	return NULL;
+	fbval_t white = FB_VAL(255, 255, 255);
+	fbval_t v = 0;
+	memcpy(&v, w->pbuf + (r * w->cols + c) * fbbpp, fbbpp);
+	return (v & white) == white;
 }
 
-static void keyboard_loop(void)
+/* find the contents of the rendered page, for backends without doc_bbox() */
+static int scanbbox(int *box)
 {
-	int c;
-	while ((c = readkey()) != -1) {
-		if (c == 'q')
-			break;
-		safe_write(STDOUT_FILENO, &c, 1);
+	struct winpage *w = winfind(num);
+	int x0, y0, x1 = 0, y1 = 0;
+	int i, j;
+	if (!w || !w->pbuf || !w->rows || !w->cols)
+		return 1;
+	x0 = w->cols;
+	y0 = w->rows;
+	for (i = 0; i < w->rows; i++) {
+		for (j = 0; j < x0 && iswhite(w, i, j); j++)
+			;
+		if (j == w->cols)
+			continue;
+		if (x0 > j)
+			x0 = j;
+		for (j = w->cols - 1; j >= x1 && iswhite(w, i, j); j--)
+			;
+		if (x1 <= j)
+			x1 = j + 1;
+		if (y0 > i)
+			y0 = i;
+		y1 = i + 1;
 	}
-	return;
+	if (x0 >= x1)
+		return 1;
+	box[0] = (long) x0 * BBOX_UNIT / w->cols;
+	box[1] = (long) y0 * BBOX_UNIT / w->rows;
+	box[2] = (long) x1 * BBOX_UNIT / w->cols;
+	box[3] = (long) y1 * BBOX_UNIT / w->rows;
+	return 0;
+}
+
+/* the content bounding box of the current page, computed once per page */
+static int *curbbox(void)
+{
+	struct pageidx *pi = pageidx(num);
+	if (!pi)
+		return NULL;
+	if (pi->bbox_rotate == rotate + 1)
+		return pi->bbox;
+	if (doc_bbox(doc, num, rotate, pi->bbox) && scanbbox(pi->bbox))
+		return NULL;
+	pi->bbox_rotate = rotate + 1;
+	return pi->bbox;
+}
+
+static int rmargin(void)
+{
+	int *box = curbbox();
+	return box ? (long) box[2] * pcols / BBOX_UNIT - 1 : pcols - 1;
+}
+
+static int lmargin(void)
+{
+	int *box = curbbox();
+	return box ? (long) box[0] * pcols / BBOX_UNIT : 0;
+}
+
+/* render the neighbours of the first page while it is rendered */
+static void warmstart(void)
+{
+	int next[3] = {num + 1, num + 2, num - 1};
+	int pages[3];
+	int i, n = 0;
+	for (i = 0; i < 3; i++)
+		if (validpage(next[i]))
+			pages[n++] = next[i];
+	render_want(pages, n, zoom, rotate);
 }
 
 static void mainloop(void)
 {
 	int step = srows / PAGESTEPS;
 	int hstep = scols / PAGESTEPS;
-	char c;
-	int j;
-	int srowmin;
-	int srowmax;
-	char *s = malloc(10*sizeof(char));
-	char *t;
+	char pat[sizeof(pattern)];
+	long t = trace_now();
+	int c, p;
+	int dx, dy;
+	trace_begin(t);
 	signal(SIGCONT, sigcont);
-	pbufs = malloc(np * sizeof(fbval_t*));
-	loadpage(num);
+	tiles = malloc((scols / TILE + 2) * sizeof(tiles[0]));
+	rbuf = malloc(scols * fbbpp);
+	render_init(doc, WORKERS, cache_mb << 20);
+	render_watch(input_wait);
+	search_init(doc, filename);
+	warmstart();
+	recolor();
+	if (loadpage(num))
+		loadpage(1);
 	srow = prow;
 	scol = -scols / 2;
-	draw();
-	if (toggleinfo)
-		printinfo();
-	while ((c = readkey()) != -1) {
+	if (resume == num && resume_zoom > 0) {
+		srow = prow + resume_row * zoom / resume_zoom;
+		scol = resume_col * zoom / resume_zoom;
+	}
+	settle();
+	update();
+	while ((c = nextkey()) != -1) {
+		t = trace_now();
 		if (c == 'q')
 			break;
 		if (c == 'e' && reload())
@@ -365,20 +1032,24 @@ static void mainloop(void)
 			break;
 		case CTRLKEY('n'):
 			toggleinfo = 1 - toggleinfo;
+			drawn = 0;
+			break;
+		case CTRLKEY('l'):
+			drawn = 0;
 			break;
 		case 27:
 			count = 0;
 			break;
 		case 'm':
-			setmark(readkey());
+			setmark(input_key());
 			break;
 		default:
-			if (isdigit(c))
+			if (c < 256 && isdigit(c))
 				count = count * 10 + c - '0';
 		}
 		if (c == '\x1b') {	/* terminal input sequence */
-			readkey();
-			switch (readkey()) {
+			input_key();
+			switch (input_key()) {
 			case 'A':
 				c = 'k';
 				break;
@@ -393,33 +1064,19 @@ static void mainloop(void)
 				break;
 			case '1':
 				c = 'g';
-				readkey();
+				input_key();
 				break;
 			case '4':
 				c = 'G';
-				readkey();
+				input_key();
 				break;
 			case '5':
 				c = 'K';
-				readkey();
+				input_key();
 				break;
 			case '6':
 				c = 'J';
-				readkey();
-				break;
-			case 'm':	/* assume mouse escape code is well-formed */
-				j = 0;
-				while ((c = readkey()) != -1) {
-					if (c == 'f') {
-						s[j] = '\0';
-						break;
-					}
-					s[j] = c;
-					j++;
-				}
-				scol += safe_strtol(s, &t, 0);
-				srow -= safe_strtol(t+1, &t, 0);	/* skip ';' */
-				c = CTRLKEY('l');	/* redraw */
+				input_key();
 				break;
 			}
 		}
@@ -436,7 +1093,7 @@ static void mainloop(void)
 			break;
 		case 'G':
 			setmark('\'');
-			if (!loadpage(getcount(doc_pages(doc) - numdiff) + numdiff))
+			if (!loadpage(getcount(render_pages() - numdiff) + numdiff))
 				srow = prow;
 			break;
 		case 'g':
@@ -475,7 +1132,7 @@ static void mainloop(void)
 				srow = prow;
 			break;
 		case '\'':
-			jmpmark(readkey());
+			jmpmark(input_key());
 			break;
 		case 'j':
 			srow += step * getcount(1);
@@ -523,51 +1180,78 @@ static void mainloop(void)
 			break;
 		case CTRLKEY('l'):
 			break;
+		case INPUT_DRAG:
+			input_drag(&dx, &dy);
+			scol += dx;
+			srow += dy;
+			break;
 		case 'i':
 			invert = !invert;
-			loadpage(num);
+			recolor();
+			break;
+		case 'c':
+			color = (color + 1) % 3;
+			recolor();
+			break;
+		case '<':
+			gamma10 = MAX(1, gamma10 - getcount(1));
+			recolor();
+			break;
+		case '>':
+			gamma10 = MIN(50, gamma10 + getcount(1));
+			recolor();
+			break;
+		case 'T':
+			trace_enable(!trace_enabled());
+			break;
+		case 'v':
+			if ((p = overview()) && p != num) {
+				setmark('\'');
+				if (!loadpage(p))
+					srow = prow;
+			}
+			drawn = 0;
+			break;
+		case '/':
+			drawn = 0;	/* the prompt is drawn over the screen */
+			if (readline("/", pat, sizeof(pat)) || !pat[0])
+				break;
+			strcpy(pattern, pat);
+			spage = 0;
+			if (search(1))
+				continue;
+			break;
+		case 'n':
+		case 'N':
+			if (!pattern[0] || search(c == 'n' ? 1 : -1))
+				continue;
 			break;
 		default:	/* no need to redraw */
 			continue;
 		}
-		srowmin = prow + prows - MARGIN;
-		srowmax = prow - srows + MARGIN;
-		srow = MAX(srowmax, MIN(srowmin, srow));
-		if (srow == srowmax)
-			if (!loadpage(num - getcount(1)))
-				srow = prow + prows;
-		if (srow == srowmin)
-			if (!loadpage(num + getcount(1)))
-				srow = prow;
-		scol = MAX(pcol - scols + MARGIN, MIN(pcol + pcols - MARGIN, scol));
-		draw();
-		if (toggleinfo)
-			printinfo();
+		trace_begin(t);
+		trace_lap(TR_INPUT, t);
+		settle();
+		if (redraw)
+			merged++;
+		redraw = 1;
 	}
-	for (j = 0; j < np; j++)
-		free(pbufs[j]);
-	free(pbufs);
-	free(s);
+	search_free();
+	thumb_free();
+	render_free();
+	winfree();
+	free(tiles);
+	free(rbuf);
+	free(pidx);
 }
 
 static char *usage =
-	"usage: fbpdf [-r rotation] [-z zoom x10] [-p page] filename\n";
+	"usage: fbpdf [-r rotation] [-z zoom x10] [-p page] [-m cache_mb] [-c disk_mb] [-t threads] [-T trace] [-b] [-v] filename\n"
+	"       fbpdf -x first[-last] [-z zoom x10] [-r rotation] [-o dir] [-j jobs] [-t threads] filename\n";
 
-int main(int argc, char *argv[])
+static void options(int argc, char *argv[])
 {
 	int i;
-	int mousekey[2];
-	pthread_t mouse_thread;
-	if (argc < 2) {
-		printf(usage);
-		return 1;
-	}
-	strcpy(filename, argv[argc - 1]);
-	doc = doc_open(filename);
-	if (!doc || !doc_pages(doc)) {
-		fprintf(stderr, "fbpdf: cannot open <%s>\n", filename);
-		return 1;
-	}
 	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
 		switch (argv[i][1]) {
 		case 'r':
@@ -579,36 +1263,107 @@ int main(int argc, char *argv[])
 		case 'p':
 			num = atoi(argv[i][2] ? argv[i] + 2 : argv[++i]);
 			break;
+		case 'm':
+			cache_mb = atol(argv[i][2] ? argv[i] + 2 : argv[++i]);
+			break;
+		case 'c':
+			disk_mb = atol(argv[i][2] ? argv[i] + 2 : argv[++i]);
+			break;
+		case 't':
+			threads = atoi(argv[i][2] ? argv[i] + 2 : argv[++i]);
+			break;
+		case 'T':
+			tracefile = argv[i][2] ? argv[i] + 2 : argv[++i];
+			break;
+		case 'x':
+			xrange = argv[i][2] ? argv[i] + 2 : argv[++i];
+			break;
+		case 'o':
+			xdir = argv[i][2] ? argv[i] + 2 : argv[++i];
+			break;
+		case 'j':
+			xjobs = atoi(argv[i][2] ? argv[i] + 2 : argv[++i]);
+			break;
+		case 'b':
+			dbuf = 1;
+			break;
+		case 'v':
+			dbuf = 2;
+			break;
 		}
 	}
-	safe_pipe(mousekey);
-	if (fork() > 0) {
+}
+
+/* render the pages given with -x into files, without the framebuffer */
+static int batch(void)
+{
+	char *s = strchr(xrange, '-');
+	int n = doc_pages(doc);
+	int beg = MAX(1, atoi(xrange));
+	int end = s ? (s[1] ? atoi(s + 1) : n) : beg;
+	int ret;
+	if (beg > MIN(n, end)) {
+		fprintf(stderr, "fbpdf: bad page range <%s>\n", xrange);
+		return 1;
+	}
+	if (fb_initmem("1x1x32"))	/* pages are rendered in its pixel format */
+		return 1;
+	conv_init();
+	doc_threads(doc, threads);
+	ret = export_pages(doc, beg, MIN(n, end), zoom, rotate, xdir,
+		xjobs > 0 ? xjobs : sysconf(_SC_NPROCESSORS_ONLN));
+	fb_free();
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	if (argc < 2) {
+		printf(usage);
+		return 1;
+	}
+	strcpy(filename, argv[argc - 1]);
+	doc = docopen(filename);
+	if (!doc) {
+		fprintf(stderr, "fbpdf: cannot open <%s>\n", filename);
+		return 1;
+	}
+	options(argc, argv);
+	if (xrange) {
+		ret = batch();
+		doc_close(doc);
+		return ret;
+	}
+	state_load();
+	options(argc, argv);	/* options take precedence over the saved state */
+	if (tracefile && trace_init(tracefile)) {
+		fprintf(stderr, "fbpdf: cannot open <%s>\n", tracefile);
+		return 1;
+	}
+	if (fb_init())
+		return 1;
+	dbuf = dbuf && !fb_double(dbuf == 2);
+	conv_init();
+	disk_init(filename, disk_mb << 20);
+	doc_threads(doc, threads);
+	srows = fb_rows();
+	scols = fb_cols();
+	if (fbbpp < 2 || fbbpp > 4) {
+		fprintf(stderr, "fbpdf: unsupported fb depth\n");
+	} else {
+		input_init();
 		term_setup();
-		int stdout_old = dup(STDOUT_FILENO);
-		safe_close(mousekey[0]);
-		safe_dup2(mousekey[1], STDOUT_FILENO);
-		safe_close(mousekey[1]);
-		safe_pthread_create(&mouse_thread, NULL, &mouse_loop, NULL);
-		keyboard_loop();
-		safe_dup2(stdout_old, STDOUT_FILENO);
-		close(stdout_old);
+		mainloop();
+		state_save();
 		term_cleanup();
-	} else {
-		safe_close(mousekey[1]);
-		safe_dup2(mousekey[0], STDIN_FILENO);
-		safe_close(mousekey[0]);
-		if (fb_init())
-			return 1;
-		srows = fb_rows();
-		scols = fb_cols();
-		if (FBM_BPP(fb_mode()) != sizeof(fbval_t))
-			fprintf(stderr, "fbpdf: fbval_t doesn't match fb depth\n");
-		else
-			mainloop();
-		pthread_kill(mouse_thread, SIGINT);
-		fb_free();
-		if (doc)
-			doc_close(doc);
+		input_free();
 	}
+	if (getenv("FBPDF_DUMP"))
+		fb_dump(getenv("FBPDF_DUMP"));
+	fb_free();
+	trace_free();
+	if (doc)
+		doc_close(doc);
 	return 0;
 }
@@ -0,0 +1,247 @@
+/*
+ * Reading input in a single process
+ *
+ * The terminal and the pointer devices are polled together.  Pointer
+ * devices are read as binary events: the /dev/input/event* devices that
+ * report relative motion or, if none can be opened, the mouse device
+ * initialized by dev-input-mice; without either, only the terminal is
+ * read.  The wheel and the side buttons are translated to the keys of
+ * the corresponding commands; motion with the middle button held is
+ * accumulated and reported as INPUT_DRAG.
+ *
+ * The render watcher calls input_wait() while the main thread renders,
+ * so the key queue is protected by a lock.
+ */
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "dev-input-mice/mouse.h"
+#include "input.h"
+
+#define NDEVS		16	/* maximum number of pointer devices */
+#define MICEPATH	"/dev/input/mice"	/* the fallback mouse device */
+#define NKEYS		512	/* the size of the key queue */
+#define NBITS(n)	((n) / 8 + 1)
+#define TESTBIT(a, n)	((a)[(n) / 8] & (1 << ((n) % 8)))
+
+enum {TTY, MICE, EVDEV};
+
+static struct pollfd fds[NDEVS + 1];
+static int kinds[NDEVS + 1];
+static int nfds;
+static int keys[NKEYS];		/* queued keys */
+static int khead, ktail;
+static int eof;			/* the terminal was closed */
+static int dragx, dragy;	/* pointer movement with the middle button held */
+static int dragged;		/* is INPUT_DRAG in the queue? */
+static int middle;		/* is the middle button of an evdev device held? */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void push(int c)
+{
+	if ((khead + 1) % NKEYS != ktail) {
+		keys[khead] = c;
+		khead = (khead + 1) % NKEYS;
+	}
+}
+
+static void drag(int dx, int dy)
+{
+	dragx += dx;
+	dragy += dy;
+	if (!dragged && (dragx || dragy)) {
+		push(INPUT_DRAG);
+		dragged = 1;
+	}
+}
+
+static void adddev(int fd, int kind)
+{
+	fds[nfds].fd = fd;
+	fds[nfds].events = POLLIN;
+	kinds[nfds] = kind;
+	nfds++;
+}
+
+/* does the evdev device report relative motion or wheel turns? */
+static int ispointer(int fd)
+{
+	unsigned char ev[NBITS(EV_MAX)] = {0};
+	unsigned char rel[NBITS(REL_MAX)] = {0};
+	if (ioctl(fd, EVIOCGBIT(0, sizeof(ev)), ev) < 0 || !TESTBIT(ev, EV_REL))
+		return 0;
+	if (ioctl(fd, EVIOCGBIT(EV_REL, sizeof(rel)), rel) < 0)
+		return 0;
+	return TESTBIT(rel, REL_X) || TESTBIT(rel, REL_WHEEL);
+}
+
+void input_init(void)
+{
+	char path[64];
+	int fd, i;
+	nfds = 0;
+	adddev(STDIN_FILENO, TTY);
+	for (i = 0; i < 32 && nfds <= NDEVS; i++) {
+		snprintf(path, sizeof(path), "/dev/input/event%d", i);
+		if ((fd = open(path, O_RDONLY | O_NONBLOCK)) < 0)
+			continue;
+		if (ispointer(fd))
+			adddev(fd, EVDEV);
+		else
+			close(fd);
+	}
+	if (nfds == 1 && (fd = open(MICEPATH, O_RDWR | O_NONBLOCK)) >= 0) {
+		init_mouse(fd);
+		adddev(fd, MICE);
+	}
+}
+
+void input_free(void)
+{
+	int i;
+	for (i = 1; i < nfds; i++)
+		if (fds[i].fd >= 0)
+			close(fds[i].fd);
+	nfds = 0;
+}
+
+static void readtty(void)
+{
+	unsigned char buf[64];
+	int i, n;
+	n = read(fds[0].fd, buf, sizeof(buf));
+	if (n <= 0 && !(n < 0 && (errno == EINTR || errno == EAGAIN)))
+		eof = 1;
+	for (i = 0; i < n; i++)
+		push(buf[i]);
+}
+
+static int readmice(int fd)
+{
+	struct packet p;
+	if (read(fd, &p, sizeof(p)) != sizeof(p))
+		return 1;
+	if (p.m)
+		drag(p.x, -p.y);
+	if (p.b)
+		push('K');
+	if (p.f)
+		push('J');
+	if (p.z == 1)
+		push('j');
+	if (p.z == 0xF)
+		push('k');
+	return 0;
+}
+
+static int readevdev(int fd)
+{
+	struct input_event ev[32];
+	int i, j, n;
+	if ((n = read(fd, ev, sizeof(ev))) <= 0)
+		return n == 0 || errno != EAGAIN;
+	for (i = 0; i < n / (int) sizeof(ev[0]); i++) {
+		if (ev[i].type == EV_KEY && ev[i].code == BTN_MIDDLE)
+			middle = ev[i].value != 0;
+		if (ev[i].type == EV_KEY && ev[i].code == BTN_SIDE && ev[i].value == 1)
+			push('K');
+		if (ev[i].type == EV_KEY && ev[i].code == BTN_EXTRA && ev[i].value == 1)
+			push('J');
+		if (ev[i].type == EV_REL && ev[i].code == REL_X && middle)
+			drag(ev[i].value, 0);
+		if (ev[i].type == EV_REL && ev[i].code == REL_Y && middle)
+			drag(0, ev[i].value);
+		if (ev[i].type == EV_REL && ev[i].code == REL_WHEEL)
+			for (j = 0; j < abs(ev[i].value); j++)
+				push(ev[i].value > 0 ? 'k' : 'j');
+	}
+	return 0;
+}
+
+/* read the devices with pending input; called with lock held */
+static void readdevs(void)
+{
+	int i;
+	if (poll(fds, nfds, 0) <= 0)
+		return;
+	for (i = 0; i < nfds; i++) {
+		if (!fds[i].revents)
+			continue;
+		if (kinds[i] == TTY) {
+			readtty();
+			continue;
+		}
+		if (kinds[i] == MICE ? readmice(fds[i].fd) : readevdev(fds[i].fd)) {
+			close(fds[i].fd);	/* poll() ignores negative descriptors */
+			fds[i].fd = -1;
+		}
+	}
+}
+
+/*
+ * Wait at most ms milliseconds for a key; is there one to read?  The end
+ * of input is not reported as a key, so that the screen is updated and
+ * renders are not cancelled after the last command; see input_eof().
+ */
+int input_wait(int ms)
+{
+	int ret;
+	pthread_mutex_lock(&lock);
+	if (khead == ktail && !eof) {
+		pthread_mutex_unlock(&lock);
+		poll(fds, nfds, ms);
+		pthread_mutex_lock(&lock);
+		readdevs();
+	} else if (khead == ktail && ms > 0) {
+		pthread_mutex_unlock(&lock);
+		poll(NULL, 0, ms);
+		pthread_mutex_lock(&lock);
+	}
+	ret = khead != ktail;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+/* were all keys read and the terminal closed? */
+int input_eof(void)
+{
+	int ret;
+	pthread_mutex_lock(&lock);
+	ret = eof && khead == ktail;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+/* wait for the next key; return -1 at the end of input */
+int input_key(void)
+{
+	int c = -1;
+	while (!input_eof() && !input_wait(-1))
+		;
+	pthread_mutex_lock(&lock);
+	if (khead != ktail) {
+		c = keys[ktail];
+		ktail = (ktail + 1) % NKEYS;
+	}
+	if (c == INPUT_DRAG)
+		dragged = 0;
+	pthread_mutex_unlock(&lock);
+	return c;
+}
+
+/* the pointer movement since the last call, with y growing downwards */
+void input_drag(int *dx, int *dy)
+{
+	pthread_mutex_lock(&lock);
+	*dx = dragx;
+	*dy = dragy;
+	dragx = 0;
+	dragy = 0;
+	pthread_mutex_unlock(&lock);
+}
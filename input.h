@@ -0,0 +1,9 @@
+/* reading keys from the terminal and pointer events from input devices */
+#define INPUT_DRAG	0x100	/* the pointer was dragged; see input_drag() */
+
+void input_init(void);
+void input_free(void);
+int input_key(void);
+int input_wait(int ms);
+int input_eof(void);
+void input_drag(int *dx, int *dy);
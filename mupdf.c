@@ -1,67 +1,486 @@
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include "mupdf/fitz.h"
 #include "draw.h"
 #include "doc.h"
+#include "conv.h"
+#include "trace.h"
 
 #define MIN_(a, b)	((a) < (b) ? (a) : (b))
+#define MAXTHREADS	16	/* maximum number of threads rendering a page */
+#define BANDMIN		64	/* minimum height of bands rendered in threads */
+#define NLISTS		8	/* display lists cached in each handle */
+
+/* a band of a page rendered by one thread */
+struct band {
+	fz_context *ctx;
+	fz_display_list *list;
+	fz_matrix ctm;
+	fz_irect bbox;		/* the part of the page in this band */
+	char *buf;
+	int stride;
+	int failed;
+	fz_cookie cookie;
+};
+
+/* the recorded contents of a page */
+struct list {
+	int page;		/* page number; zero if empty */
+	fz_display_list *list;
+	fz_rect bounds;		/* the page box */
+	long used;		/* the last time this list was used */
+};
 
 struct doc {
 	fz_context *ctx;
 	fz_document *pdf;
+	fz_cookie cookie;	/* its abort field cancels renders */
+	char *path;
+	int threads;		/* the number of threads rendering each page */
+	struct band bands[MAXTHREADS];
+	struct list lists[NLISTS];	/* recently used display lists */
+	long ticks;
 };
 
+/* mupdf contexts cloned for other threads share these locks */
+static pthread_mutex_t locks[FZ_LOCK_MAX];
+static pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+
+static void locks_init(void)
+{
+	int i;
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		pthread_mutex_init(&locks[i], NULL);
+}
+
+static void lock_mutex(void *user, int lock)
+{
+	pthread_mutex_lock(&locks[lock]);
+}
+
+static void unlock_mutex(void *user, int lock)
+{
+	pthread_mutex_unlock(&locks[lock]);
+}
+
+static fz_locks_context fz_locks = {NULL, lock_mutex, unlock_mutex};
+
+/* clones open the document in the thread using them, on first use */
+static fz_document *docpdf(struct doc *doc)
+{
+	if (!doc->pdf)
+		doc->pdf = fz_open_document(doc->ctx, doc->path);
+	return doc->pdf;
+}
+
+static fz_matrix pagectm(int zoom, int rotate)
+{
+	fz_matrix ctm = fz_scale((float) zoom / 10, (float) zoom / 10);
+	return fz_pre_rotate(ctm, rotate);
+}
+
+/*
+ * Return the display list of a page.  Pages are interpreted once and
+ * recorded; changing zoom or rotation only rasterizes the list again.
+ * The least recently used list is dropped to make room.
+ */
+static struct list *pagelist(struct doc *doc, int p)
+{
+	fz_context *ctx = doc->ctx;
+	struct list *l = &doc->lists[0];
+	fz_page *page = NULL;
+	fz_device *dev = NULL;
+	fz_display_list *list = NULL;
+	fz_rect bounds;
+	long t;
+	int i;
+	for (i = 0; i < NLISTS; i++) {
+		if (doc->lists[i].page == p) {
+			doc->lists[i].used = ++doc->ticks;
+			return &doc->lists[i];
+		}
+		if (doc->lists[i].used < l->used)
+			l = &doc->lists[i];
+	}
+	fz_var(page);
+	fz_var(dev);
+	fz_var(list);
+	t = trace_now();
+	fz_try (ctx) {
+		page = fz_load_page(ctx, docpdf(doc), p - 1);
+		bounds = fz_bound_page(ctx, page);
+		list = fz_new_display_list(ctx, bounds);
+		dev = fz_new_list_device(ctx, list);
+		fz_run_page(ctx, page, dev, fz_identity, &doc->cookie);
+		fz_close_device(ctx, dev);
+		if (doc->cookie.abort)		/* the list is incomplete */
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cancelled");
+	} fz_always (ctx) {
+		fz_drop_device(ctx, dev);
+		fz_drop_page(ctx, page);
+	} fz_catch (ctx) {
+		fz_drop_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+	trace_lap(TR_RASTER, t);
+	fz_drop_display_list(ctx, l->list);
+	l->page = p;
+	l->list = list;
+	l->bounds = bounds;
+	l->used = ++doc->ticks;
+	return l;
+}
+
+/* the bounding box of the rendered page in device space */
+static fz_irect pagebox(struct list *l, fz_matrix ctm)
+{
+	return fz_round_rect(fz_transform_rect(l->bounds, ctm));
+}
+
+/*
+ * Render the bbox part of the display list into buf.  If the
+ * framebuffer stores pixels as blue, green and red bytes, the pixmap
+ * wraps buf and mupdf draws into it directly; otherwise the rows are
+ * converted.
+ */
+static void pixrender(fz_context *ctx, fz_display_list *list,
+		fz_matrix ctm, fz_irect bbox, char *buf, int stride, fz_cookie *cookie)
+{
+	fz_pixmap *pix = NULL;
+	fz_device *dev = NULL;
+	int w = bbox.x1 - bbox.x0;
+	int h = bbox.y1 - bbox.y0;
+	int direct = conv_bgr();
+	long t = trace_now();
+	int y;
+	fz_var(pix);
+	fz_var(dev);
+	fz_try (ctx) {
+		if (cookie->abort)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cancelled");
+		if (direct) {
+			pix = fz_new_pixmap_with_data(ctx, fz_device_bgr(ctx),
+					w, h, NULL, fbbpp == 4, stride, (unsigned char *) buf);
+			pix->x = bbox.x0;
+			pix->y = bbox.y0;
+		} else {
+			pix = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), bbox, NULL, 0);
+		}
+		fz_clear_pixmap_with_value(ctx, pix, 0xff);
+		dev = fz_new_draw_device(ctx, fz_identity, pix);
+		fz_run_display_list(ctx, list, dev, ctm, fz_rect_from_irect(bbox), cookie);
+		fz_close_device(ctx, dev);
+		if (cookie->abort)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cancelled");
+		t = trace_lap(TR_RASTER, t);
+		if (!direct)
+			for (y = 0; y < h; y++)
+				conv_rgb24(buf + y * stride, &pix->samples[y * pix->stride], w);
+		trace_lap(TR_CONV, t);
+	} fz_always (ctx) {
+		fz_drop_device(ctx, dev);
+		fz_drop_pixmap(ctx, pix);
+	} fz_catch (ctx) {
+		fz_rethrow(ctx);
+	}
+}
+
+static void *bandrender(void *arg)
+{
+	struct band *b = arg;
+	fz_try (b->ctx)
+		pixrender(b->ctx, b->list, b->ctm, b->bbox, b->buf, b->stride, &b->cookie);
+	fz_catch (b->ctx)
+		b->failed = 1;
+	return NULL;
+}
+
+/*
+ * Render the display list in horizontal bands in parallel.  Threads
+ * with cloned contexts render into disjoint rows of buf; the calling
+ * thread renders the first band.
+ */
+static void bandsrender(struct doc *doc, fz_display_list *list, fz_matrix ctm,
+		fz_irect bbox, char *buf, int stride)
+{
+	fz_context *ctx = doc->ctx;
+	pthread_t threads[MAXTHREADS];
+	int started[MAXTHREADS] = {0};
+	int n = MIN_(doc->threads, (bbox.y1 - bbox.y0) / BANDMIN);
+	int bh = (bbox.y1 - bbox.y0 + n - 1) / n;
+	int failed = 0;
+	int i;
+	for (i = 0; i < n; i++) {
+		struct band *b = &doc->bands[i];
+		b->list = list;
+		b->ctm = ctm;
+		b->bbox = bbox;
+		b->bbox.y0 = bbox.y0 + i * bh;
+		b->bbox.y1 = MIN_(bbox.y1, b->bbox.y0 + bh);
+		b->buf = buf + (long) i * bh * stride;
+		b->stride = stride;
+		b->failed = 0;
+		memset(&b->cookie, 0, sizeof(b->cookie));
+		b->cookie.abort = doc->cookie.abort;
+		b->ctx = i ? fz_clone_context(ctx) : NULL;
+		if (b->ctx && !pthread_create(&threads[i], NULL, bandrender, b)) {
+			started[i] = 1;
+		} else {
+			if (b->ctx)
+				fz_drop_context(b->ctx);
+			b->ctx = ctx;
+		}
+	}
+	for (i = 0; i < n; i++)		/* bands without a thread */
+		if (!started[i])
+			bandrender(&doc->bands[i]);
+	for (i = 0; i < n; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+			fz_drop_context(doc->bands[i].ctx);
+		}
+		failed |= doc->bands[i].failed;
+	}
+	if (failed || doc->cookie.abort)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cancelled");
+}
+
+static void pagerender(struct doc *doc, struct list *l, fz_matrix ctm,
+		fz_irect bbox, char *buf, int stride)
+{
+	if (doc->threads > 1 && bbox.y1 - bbox.y0 >= 2 * BANDMIN)
+		bandsrender(doc, l->list, ctm, bbox, buf, stride);
+	else
+		pixrender(doc->ctx, l->list, ctm, bbox, buf, stride, &doc->cookie);
+}
+
 void *doc_draw(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
 {
-	fz_matrix ctm;
-	fz_pixmap *pix;
-	fbval_t *pbuf;
-	int x, y;
-	ctm = fz_scale((float) zoom / 10, (float) zoom / 10);
-	ctm = fz_pre_rotate(ctm, rotate);
-	pix = fz_new_pixmap_from_page_number(doc->ctx, doc->pdf,
-			p - 1, ctm, fz_device_rgb(doc->ctx), 0);
-	if (!pix)
-		return NULL;
-	if (!(pbuf = malloc(pix->w * pix->h * sizeof(pbuf[0])))) {
-		fz_drop_pixmap(doc->ctx, pix);
+	fz_matrix ctm = pagectm(zoom, rotate);
+	struct list *l;
+	char *pbuf = NULL;
+	fz_irect bbox;
+	fz_var(pbuf);
+	fz_try (doc->ctx) {
+		l = pagelist(doc, p);
+		bbox = pagebox(l, ctm);
+		*cols = bbox.x1 - bbox.x0;
+		*rows = bbox.y1 - bbox.y0;
+		if (!(pbuf = malloc(*rows * *cols * fbbpp)))
+			fz_throw(doc->ctx, FZ_ERROR_GENERIC, "out of memory");
+		pagerender(doc, l, ctm, bbox, pbuf, *cols * fbbpp);
+	} fz_catch (doc->ctx) {
+		free(pbuf);
 		return NULL;
 	}
-	for (y = 0; y < pix->h; y++) {
-		unsigned char *s = &pix->samples[y * pix->stride];
-		for (x = 0; x < pix->w; x++)
-			pbuf[y * pix->w + x] = FB_VAL(s[x * pix->n + 0],
-					s[x * pix->n + 1], s[x * pix->n + 2]);
-	}
-	fz_drop_pixmap(doc->ctx, pix);
-	*cols = pix->w;
-	*rows = pix->h;
 	return pbuf;
 }
 
-int doc_pages(struct doc *doc)
+/* the page box of a cached list is used; otherwise the page is only loaded */
+int doc_size(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
 {
-	return fz_count_pages(doc->ctx, doc->pdf);
+	fz_matrix ctm = pagectm(zoom, rotate);
+	fz_page *page = NULL;
+	fz_rect bounds;
+	fz_irect bbox;
+	int i;
+	for (i = 0; i < NLISTS; i++)
+		if (doc->lists[i].page == p)
+			break;
+	fz_var(page);
+	fz_try (doc->ctx) {
+		if (i < NLISTS) {
+			bounds = doc->lists[i].bounds;
+		} else {
+			page = fz_load_page(doc->ctx, docpdf(doc), p - 1);
+			bounds = fz_bound_page(doc->ctx, page);
+		}
+	} fz_always (doc->ctx) {
+		fz_drop_page(doc->ctx, page);
+	} fz_catch (doc->ctx) {
+		return 1;
+	}
+	bbox = fz_round_rect(fz_transform_rect(bounds, ctm));
+	*cols = bbox.x1 - bbox.x0;
+	*rows = bbox.y1 - bbox.y0;
+	return 0;
 }
 
-struct doc *doc_open(char *path)
+int doc_render(struct doc *doc, int p, int zoom, int rotate,
+		int x, int y, int w, int h, void *buf, int stride)
+{
+	fz_matrix ctm = pagectm(zoom, rotate);
+	struct list *l;
+	fz_irect bbox;
+	fz_try (doc->ctx) {
+		l = pagelist(doc, p);
+		bbox = pagebox(l, ctm);
+		bbox.x0 += x;
+		bbox.y0 += y;
+		bbox.x1 = bbox.x0 + w;
+		bbox.y1 = bbox.y0 + h;
+		pagerender(doc, l, ctm, bbox, buf, stride);
+	} fz_catch (doc->ctx) {
+		return 1;
+	}
+	return 0;
+}
+
+/* the bbox device finds the area drawn on the page without rendering it */
+int doc_bbox(struct doc *doc, int p, int rotate, int *box)
 {
-	struct doc *doc = malloc(sizeof(*doc));
-	doc->ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
-	fz_register_document_handlers(doc->ctx);
+	fz_matrix ctm = pagectm(10, rotate);
+	fz_device *dev = NULL;
+	fz_rect rect = fz_empty_rect;
+	fz_rect bounds;
+	struct list *l;
+	fz_var(dev);
 	fz_try (doc->ctx) {
-		doc->pdf = fz_open_document(doc->ctx, path);
+		l = pagelist(doc, p);
+		bounds = fz_transform_rect(l->bounds, ctm);
+		dev = fz_new_bbox_device(doc->ctx, &rect);
+		fz_run_display_list(doc->ctx, l->list, dev, ctm, bounds, NULL);
+		fz_close_device(doc->ctx, dev);
+	} fz_always (doc->ctx) {
+		fz_drop_device(doc->ctx, dev);
 	} fz_catch (doc->ctx) {
-		fz_drop_context(doc->ctx);
-		free(doc);
+		return 1;
+	}
+	rect = fz_intersect_rect(rect, bounds);
+	if (fz_is_empty_rect(rect))
+		return 1;
+	box[0] = (rect.x0 - bounds.x0) * BBOX_UNIT / (bounds.x1 - bounds.x0);
+	box[1] = (rect.y0 - bounds.y0) * BBOX_UNIT / (bounds.y1 - bounds.y0);
+	box[2] = (rect.x1 - bounds.x0) * BBOX_UNIT / (bounds.x1 - bounds.x0);
+	box[3] = (rect.y1 - bounds.y0) * BBOX_UNIT / (bounds.y1 - bounds.y0);
+	return 0;
+}
+
+/* the text device groups characters into lines */
+char *doc_text(struct doc *doc, int p)
+{
+	fz_context *ctx = doc->ctx;
+	fz_stext_page *text = NULL;
+	fz_device *dev = NULL;
+	fz_buffer *buf = NULL;
+	fz_stext_block *b;
+	fz_stext_line *ln;
+	fz_stext_char *ch;
+	fz_rect bounds;
+	struct list *l;
+	char *s = NULL;
+	fz_var(text);
+	fz_var(dev);
+	fz_var(buf);
+	fz_var(s);
+	fz_try (ctx) {
+		l = pagelist(doc, p);
+		bounds = l->bounds;
+		text = fz_new_stext_page(ctx, bounds);
+		dev = fz_new_stext_device(ctx, text, NULL);
+		fz_run_display_list(ctx, l->list, dev, fz_identity, bounds, NULL);
+		fz_close_device(ctx, dev);
+		buf = fz_new_buffer(ctx, 1024);
+		for (b = text->first_block; b; b = b->next) {
+			if (b->type != FZ_STEXT_BLOCK_TEXT)
+				continue;
+			for (ln = b->u.t.first_line; ln; ln = ln->next) {
+				fz_append_printf(ctx, buf, "%d %d ",
+					(int) ((ln->bbox.x0 - bounds.x0) * BBOX_UNIT / (bounds.x1 - bounds.x0)),
+					(int) ((ln->bbox.y0 - bounds.y0) * BBOX_UNIT / (bounds.y1 - bounds.y0)));
+				for (ch = ln->first_char; ch; ch = ch->next)
+					fz_append_rune(ctx, buf, ch->c == '\n' ? ' ' : ch->c);
+				fz_append_byte(ctx, buf, '\n');
+			}
+		}
+		s = strdup(fz_string_from_buffer(ctx, buf));
+	} fz_always (ctx) {
+		fz_drop_buffer(ctx, buf);
+		fz_drop_device(ctx, dev);
+		fz_drop_stext_page(ctx, text);
+	} fz_catch (ctx) {
 		return NULL;
 	}
+	return s;
+}
+
+void doc_cancel(struct doc *doc, int cancel)
+{
+	int i;
+	doc->cookie.abort = cancel;
+	for (i = 0; i < MAXTHREADS; i++)
+		doc->bands[i].cookie.abort = cancel;
+}
+
+void doc_threads(struct doc *doc, int n)
+{
+	doc->threads = n < MAXTHREADS ? n : MAXTHREADS;
+}
+
+int doc_pages(struct doc *doc)
+{
+	int n = 0;
+	fz_var(n);
+	fz_try (doc->ctx)
+		n = fz_count_pages(doc->ctx, docpdf(doc));
+	fz_catch (doc->ctx)
+		return 0;
+	return n;
+}
+
+static struct doc *doc_new(fz_context *ctx, char *path)
+{
+	struct doc *doc = calloc(1, sizeof(*doc));
+	if (!doc) {
+		fz_drop_context(ctx);
+		return NULL;
+	}
+	doc->ctx = ctx;
+	doc->path = strdup(path);
 	return doc;
 }
 
+struct doc *doc_open(char *path)
+{
+	struct doc *doc;
+	fz_context *ctx;
+	pthread_once(&locks_once, locks_init);
+	ctx = fz_new_context(NULL, &fz_locks, FZ_STORE_DEFAULT);
+	if (!ctx)
+		return NULL;
+	fz_register_document_handlers(ctx);
+	if (!(doc = doc_new(ctx, path)))
+		return NULL;
+	fz_try (ctx) {
+		docpdf(doc);
+	} fz_catch (ctx) {
+		doc_close(doc);
+		return NULL;
+	}
+	return doc;
+}
+
+/*
+ * A handle sharing the resource store of doc for use in another thread.
+ * Only the context is cloned here; the document is opened when the
+ * handle is first used, in its own thread.
+ */
+struct doc *doc_clone(struct doc *doc)
+{
+	fz_context *ctx = fz_clone_context(doc->ctx);
+	if (!ctx)
+		return NULL;
+	return doc_new(ctx, doc->path);
+}
+
 void doc_close(struct doc *doc)
 {
+	int i;
+	for (i = 0; i < NLISTS; i++)
+		fz_drop_display_list(doc->ctx, doc->lists[i].list);
 	fz_drop_document(doc->ctx, doc->pdf);
 	fz_drop_context(doc->ctx);
+	free(doc->path);
 	free(doc);
 }
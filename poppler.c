@@ -1,21 +1,76 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <string>
+#include <vector>
 #include <poppler/cpp/poppler-document.h>
 #include <poppler/cpp/poppler-image.h>
 #include <poppler/cpp/poppler-page.h>
 #include <poppler/cpp/poppler-page-renderer.h>
 
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+#define NBANDS		4	/* bands of a page checked for cancellation */
+#define MINBAND		512	/* rows of the smallest band */
+#define NCACHED		8	/* page objects kept in each handle */
 
 extern "C" {
 #include "draw.h"
 #include "doc.h"
+#include "conv.h"
+#include "trace.h"
 }
 
+/* a loaded page */
+struct cached {
+	int n;			/* page number; zero if empty */
+	poppler::page *page;
+	long used;		/* the last time this page was used */
+};
+
 struct doc {
 	poppler::document *doc;
+	char *path;
+	poppler::page_renderer *pr;	/* the renderer of this handle */
+	struct cached pages[NCACHED];
+	long ticks;
+	volatile int cancel;	/* set by doc_cancel() */
 };
 
+/* clones load the document in the thread using them, on first use */
+static poppler::document *document(struct doc *doc)
+{
+	if (!doc->doc)
+		doc->doc = poppler::document::load_from_file(doc->path);
+	return doc->doc;
+}
+
+/*
+ * Return page p, loading it if it is not cached.  Each handle is used
+ * by one thread at a time, so pages and the renderer need no locks.
+ */
+static poppler::page *docpage(struct doc *doc, int p)
+{
+	struct cached *c = &doc->pages[0];
+	int i;
+	for (i = 0; i < NCACHED; i++) {
+		if (doc->pages[i].n == p) {
+			doc->pages[i].used = ++doc->ticks;
+			return doc->pages[i].page;
+		}
+		if (doc->pages[i].used < c->used)
+			c = &doc->pages[i];
+	}
+	poppler::page *page = document(doc) ? doc->doc->create_page(p - 1) : NULL;
+	if (!page)
+		return NULL;
+	delete c->page;
+	c->n = p;
+	c->page = page;
+	c->used = ++doc->ticks;
+	return page;
+}
+
 static poppler::rotation_enum rotation(int times)
 {
 	if (times == 1)
@@ -27,55 +82,190 @@ static poppler::rotation_enum rotation(int times)
 	return poppler::rotate_0;
 }
 
+/*
+ * Poppler images store pixels as blue, green, red and alpha bytes.  The
+ * part of buf not covered by a smaller image is zero-filled.
+ */
+static void img2buf(poppler::image &img, char *buf, int stride, int w, int h)
+{
+	char *dat = img.data();
+	int direct = conv_bgr() && fbbpp == 4;
+	int iw = MAX(0, MIN(w, img.width()));
+	int ih = MAX(0, MIN(h, img.height()));
+	int y;
+	for (y = 0; y < ih; y++) {
+		if (direct)
+			memcpy(buf + y * stride, dat + img.bytes_per_row() * y, iw * 4);
+		else
+			conv_bgrx(buf + y * stride, (unsigned char *) dat +
+					img.bytes_per_row() * y, iw);
+		memset(buf + y * stride + iw * fbbpp, 0, (w - iw) * fbbpp);
+	}
+	for (y = ih; y < h; y++)
+		memset(buf + y * stride, 0, w * fbbpp);
+}
+
+/*
+ * Render the page in a few bands, checking for cancellation between
+ * them.  Poppler interprets the whole page for each band, and for each
+ * tile, so only parts much taller than MINBAND are split, into bands of
+ * equal height; tiles are rendered in one band.
+ */
+static int render(struct doc *doc, int p, int zoom, int rotate,
+		int x, int y, int w, int h, char *buf, int stride)
+{
+	poppler::page *page = docpage(doc, p);
+	int nbands = h > 2 * MINBAND ? MIN(NBANDS, h / MINBAND) : 1;
+	int band = (h + nbands - 1) / nbands;
+	int i, n;
+	if (!page)
+		return 1;
+	for (i = 0; i < h && !doc->cancel; i += n) {
+		long t = trace_now();
+		n = MIN(band, h - i);
+		poppler::image img = doc->pr->render_page(page, 72 * zoom / 10, 72 * zoom / 10,
+					x, y + i, w, n, rotation((rotate + 89) / 90));
+		if (!img.is_valid())
+			break;
+		t = trace_lap(TR_RASTER, t);
+		img2buf(img, buf + i * stride, stride, w, n);
+		trace_lap(TR_CONV, t);
+	}
+	return i < h;
+}
+
 void *doc_draw(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
 {
-	poppler::page *page = doc->doc->create_page(p - 1);
-	poppler::page_renderer pr;
-	int x, y;
-	int h, w;
-	fbval_t *pbuf;
-	unsigned char *dat;
-	pr.set_render_hint(poppler::page_renderer::antialiasing, true);
-	pr.set_render_hint(poppler::page_renderer::text_antialiasing, true);
-	poppler::image img = pr.render_page(page, 72 * zoom / 10, 72 * zoom / 10,
-				-1, -1, -1, -1, rotation((rotate + 89) / 90));
-	h = img.height();
-	w = img.width();
-	dat = (unsigned char *) img.data();
-	if (!(pbuf = (fbval_t *) malloc(h * w * sizeof(pbuf[0])))) {
-		delete page;
+	char *pbuf;
+	if (doc_size(doc, p, zoom, rotate, rows, cols))
+		return NULL;
+	if (!(pbuf = (char *) malloc(*rows * *cols * fbbpp)))
+		return NULL;
+	if (render(doc, p, zoom, rotate, 0, 0, *cols, *rows, pbuf, *cols * fbbpp)) {
+		free(pbuf);
 		return NULL;
 	}
-	for (y = 0; y < h; y++) {
-		unsigned char *s = dat + img.bytes_per_row() * y;
-		for (x = 0; x < w; x++)
-			pbuf[y * w + x] = FB_VAL(s[x * 4 + 2],
-					s[x * 4 + 1], s[x * 4 + 0]);
-	}
-	*rows = h;
-	*cols = w;
-	delete page;
 	return pbuf;
 }
 
+int doc_render(struct doc *doc, int p, int zoom, int rotate,
+		int x, int y, int w, int h, void *buf, int stride)
+{
+	return render(doc, p, zoom, rotate, x, y, w, h, (char *) buf, stride);
+}
+
+int doc_size(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
+{
+	poppler::page *page = docpage(doc, p);
+	int quarters = (rotate + 89) / 90;
+	if (!page)
+		return 1;
+	poppler::rectf rect = page->page_rect();
+	if (page->orientation() == poppler::page::landscape ||
+			page->orientation() == poppler::page::seascape)
+		quarters++;
+	*cols = (int) (rect.width() * (72 * zoom / 10) / 72 + 0.5);
+	*rows = (int) (rect.height() * (72 * zoom / 10) / 72 + 0.5);
+	if (quarters & 1) {
+		int t = *cols;
+		*cols = *rows;
+		*rows = t;
+	}
+	return 0;
+}
+
+/* fbpdf finds the contents in the rendered page */
+int doc_bbox(struct doc *doc, int p, int rotate, int *box)
+{
+	return 1;
+}
+
+/* words are placed on the line of the previous word, if they overlap vertically */
+char *doc_text(struct doc *doc, int p)
+{
+	poppler::page *page = docpage(doc, p);
+	std::string text;
+	char pos[64];
+	double top = 0, bot = 0;
+	size_t i;
+	if (!page)
+		return NULL;
+	poppler::rectf rect = page->page_rect();
+	std::vector<poppler::text_box> words = page->text_list();
+	for (i = 0; i < words.size(); i++) {
+		poppler::rectf box = words[i].bbox();
+		double mid = box.y() + box.height() / 2;
+		if (i == 0 || mid < top || mid > bot) {
+			if (i)
+				text += '\n';
+			snprintf(pos, sizeof(pos), "%d %d ",
+				(int) ((box.x() - rect.x()) * BBOX_UNIT / rect.width()),
+				(int) ((box.y() - rect.y()) * BBOX_UNIT / rect.height()));
+			text += pos;
+			top = box.y();
+			bot = box.y() + box.height();
+		} else {
+			text += ' ';
+		}
+		poppler::byte_array word = words[i].text().to_utf8();
+		text.append(word.data(), word.size());
+	}
+	if (i)
+		text += '\n';
+	return strdup(text.c_str());
+}
+
+void doc_cancel(struct doc *doc, int cancel)
+{
+	doc->cancel = cancel;
+}
+
+/* pages are rendered in one thread */
+void doc_threads(struct doc *doc, int n)
+{
+}
+
 int doc_pages(struct doc *doc)
 {
-	return doc->doc->pages();
+	return document(doc) ? doc->doc->pages() : 0;
+}
+
+static struct doc *doc_new(char *path)
+{
+	struct doc *doc = (struct doc *) calloc(1, sizeof(*doc));
+	doc->path = strdup(path);
+	doc->pr = new poppler::page_renderer();
+	doc->pr->set_render_hint(poppler::page_renderer::antialiasing, true);
+	doc->pr->set_render_hint(poppler::page_renderer::text_antialiasing, true);
+	return doc;
 }
 
 struct doc *doc_open(char *path)
 {
-	struct doc *doc = (struct doc *) malloc(sizeof(*doc));
-	doc->doc = poppler::document::load_from_file(path);
-	if (!doc->doc) {
+	struct doc *doc = doc_new(path);
+	if (!document(doc)) {
 		doc_close(doc);
 		return NULL;
 	}
 	return doc;
 }
 
+/*
+ * Each handle loads the document itself, so they can be used in
+ * parallel; clones load it when first used, in their own thread.
+ */
+struct doc *doc_clone(struct doc *doc)
+{
+	return doc_new(doc->path);
+}
+
 void doc_close(struct doc *doc)
 {
+	int i;
+	for (i = 0; i < NCACHED; i++)
+		delete doc->pages[i].page;
+	delete doc->pr;
 	delete doc->doc;
+	free(doc->path);
 	free(doc);
 }
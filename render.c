@@ -0,0 +1,635 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "doc.h"
+#include "disk.h"
+#include "render.h"
+
+#define NWANT		8	/* maximum number of pages to prefetch */
+#define NWANTTILES	256	/* maximum number of tiles to prefetch */
+#define NSLOTS		512	/* maximum number of cached pages and tiles */
+#define WATCHMS		20	/* how often the watcher checks if rendering is over */
+
+struct slot {
+	int page, zoom, rotate;	/* the cache key; page is zero if empty */
+	int x, y;		/* tile position; -1 for whole pages */
+	int busy;		/* the worker rendering it plus one, or zero */
+	int refs;		/* the number of users of a tile */
+	int stale;		/* its render was cancelled as no longer wanted */
+	int failed;		/* could not be rendered; retried after render_want() */
+	int unsaved;		/* to be written to the disk cache by a worker */
+	void *pbuf;
+	int rows, cols;
+	long used;		/* the last time this slot was used */
+};
+
+static struct doc *doc;		/* the handle used by the main thread */
+static struct doc **docs;	/* per-worker handles */
+static pthread_t *threads;
+static int nthreads;
+static pthread_t watch_thread;
+static int watching;		/* is the watcher running? */
+static int (*watch)(int ms);	/* waits for input that cancels main thread renders */
+static int rendering;		/* is the main thread rendering? */
+static int cancelled;		/* were renders in the main thread cancelled? */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct slot slots[NSLOTS];
+static long budget;		/* maximum size of cached pages in bytes */
+static long ticks;		/* incremented for each use of a slot */
+static int hits, misses;
+static int want[NWANT];		/* pages to prefetch in order of priority */
+static int nwant;
+static int want_zoom, want_rotate;
+static struct tilepos wtiles[NWANTTILES];	/* tiles to prefetch after pages */
+static int nwtiles;
+static int wtile_zoom, wtile_rotate;
+static int quit;
+static int npages = -1;		/* the number of pages; -1 until counted */
+static int count_id;		/* identifies the document being counted */
+
+struct count {
+	struct doc *doc;	/* the handle used for counting pages */
+	int id;
+};
+
+static long slot_size(struct slot *s)
+{
+	return (long) s->rows * s->cols * fbbpp;
+}
+
+static struct slot *slot_find(int page, int zoom, int rotate, int x, int y)
+{
+	int i;
+	for (i = 0; i < NSLOTS; i++)
+		if (slots[i].page == page && slots[i].zoom == zoom &&
+				slots[i].rotate == rotate &&
+				slots[i].x == x && slots[i].y == y)
+			return &slots[i];
+	return NULL;
+}
+
+static int wanted(struct slot *s)
+{
+	int i;
+	if (s->x >= 0) {
+		if (s->zoom != wtile_zoom || s->rotate != wtile_rotate)
+			return 0;
+		for (i = 0; i < nwtiles; i++)
+			if (wtiles[i].page == s->page &&
+					wtiles[i].x == s->x && wtiles[i].y == s->y)
+				return 1;
+		return 0;
+	}
+	if (s->zoom != want_zoom || s->rotate != want_rotate)
+		return 0;
+	for (i = 0; i < nwant; i++)
+		if (want[i] == s->page)
+			return 1;
+	return 0;
+}
+
+static void slot_drop(struct slot *s)
+{
+	render_release(s->pbuf);
+	memset(s, 0, sizeof(*s));
+}
+
+/* the least recently used slot that is neither being rendered nor used */
+static struct slot *slot_lru(int skipwanted)
+{
+	struct slot *lru = NULL;
+	int i;
+	for (i = 0; i < NSLOTS; i++) {
+		struct slot *s = &slots[i];
+		if (!s->page || s->busy || s->refs || (skipwanted && wanted(s)))
+			continue;
+		if (!lru || s->used < lru->used)
+			lru = s;
+	}
+	return lru;
+}
+
+static struct slot *slot_evict(void)
+{
+	struct slot *s = slot_lru(1);
+	if (!s)
+		s = slot_lru(0);
+	if (s)
+		slot_drop(s);
+	return s;
+}
+
+static struct slot *slot_new(void)
+{
+	int i;
+	for (i = 0; i < NSLOTS; i++)
+		if (!slots[i].page)
+			return &slots[i];
+	return slot_evict();
+}
+
+/* evict pages until the total size is within the budget */
+static void shrink(long size)
+{
+	long total = size;
+	int i;
+	for (i = 0; i < NSLOTS; i++)
+		total += slot_size(&slots[i]);
+	while (total > budget) {
+		struct slot *s = slot_lru(1);
+		if (!s)
+			s = slot_lru(0);
+		if (!s)
+			break;
+		total -= slot_size(s);
+		slot_drop(s);
+	}
+}
+
+/* find a wanted page or tile which is neither rendered nor being rendered */
+static struct slot *job(int id)
+{
+	struct slot *s;
+	struct tilepos *t;
+	long size = 0;
+	int i;
+	for (i = 0; i < NSLOTS; i++)
+		if (slots[i].page && wanted(&slots[i]))
+			size += slot_size(&slots[i]);
+	if (size >= budget)
+		return NULL;
+	for (i = 0; i < nwant; i++) {
+		if (slot_find(want[i], want_zoom, want_rotate, -1, -1))
+			continue;
+		if (!(s = slot_new()))
+			return NULL;
+		s->page = want[i];
+		s->zoom = want_zoom;
+		s->rotate = want_rotate;
+		s->x = -1;
+		s->y = -1;
+		s->busy = id + 1;
+		return s;
+	}
+	for (i = 0; i < nwtiles; i++) {
+		t = &wtiles[i];
+		if (slot_find(t->page, wtile_zoom, wtile_rotate, t->x, t->y))
+			continue;
+		if (!(s = slot_new()))
+			return NULL;
+		s->page = t->page;
+		s->zoom = wtile_zoom;
+		s->rotate = wtile_rotate;
+		s->x = t->x;
+		s->y = t->y;
+		s->rows = t->h;	/* the size of the tile to render */
+		s->cols = t->w;
+		s->busy = id + 1;
+		return s;
+	}
+	return NULL;
+}
+
+/* drop the slots that failed to render so that they are retried */
+static void drop_failed(void)
+{
+	int i;
+	for (i = 0; i < NSLOTS; i++)
+		if (slots[i].failed)
+			slot_drop(&slots[i]);
+}
+
+/* a page rendered by the main thread and not yet written to the disk cache */
+static struct slot *unsaved(void)
+{
+	int i;
+	for (i = 0; i < NSLOTS; i++)
+		if (slots[i].page && slots[i].unsaved)
+			return &slots[i];
+	return NULL;
+}
+
+/*
+ * Render the whole page if x is negative; whole pages are cached on
+ * disk too.  If unsaved is not NULL, rendered pages are not written to
+ * the disk cache and *unsaved is set instead.
+ */
+static void *draw(struct doc *doc, int page, int zoom, int rotate,
+		int x, int y, int *rows, int *cols, int *unsaved)
+{
+	char *pbuf;
+	if (x < 0) {
+		if ((pbuf = disk_load(page, zoom, rotate, rows, cols)))
+			return pbuf;
+		if (!(pbuf = doc_draw(doc, page, zoom, rotate, rows, cols)))
+			return NULL;
+		if (unsaved)
+			*unsaved = 1;
+		else
+			disk_save(page, zoom, rotate, pbuf, *rows, *cols);
+	} else if ((pbuf = malloc((long) *rows * *cols * fbbpp))) {
+		if (doc_render(doc, page, zoom, rotate, x, y, *cols, *rows,
+				pbuf, *cols * fbbpp)) {
+			free(pbuf);
+			pbuf = NULL;
+		}
+	}
+	return pbuf;
+}
+
+/* write the page of slot s to the disk cache; called with lock held */
+static void save(struct slot *s)
+{
+	s->unsaved = 0;
+	s->refs++;		/* keep it while writing */
+	pthread_mutex_unlock(&lock);
+	disk_save(s->page, s->zoom, s->rotate, s->pbuf, s->rows, s->cols);
+	pthread_mutex_lock(&lock);
+	s->refs--;
+}
+
+static void *worker(void *arg)
+{
+	int id = (long) arg;
+	struct doc *wdoc = docs[id];
+	struct slot *s;
+	void *pbuf;
+	int page, zoom, rotate, x, y;
+	int rows, cols;
+	pthread_mutex_lock(&lock);
+	while (!quit) {
+		if (!(s = job(id))) {
+			if ((s = unsaved()))
+				save(s);
+			else
+				pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		page = s->page;
+		zoom = s->zoom;
+		rotate = s->rotate;
+		x = s->x;
+		y = s->y;
+		rows = s->rows;
+		cols = s->cols;
+		pthread_mutex_unlock(&lock);
+		pbuf = draw(wdoc, page, zoom, rotate, x, y, &rows, &cols, NULL);
+		pthread_mutex_lock(&lock);
+		doc_cancel(wdoc, 0);
+		s->busy = 0;
+		if (pbuf) {
+			s->pbuf = pbuf;
+			s->rows = rows;
+			s->cols = cols;
+			s->used = ++ticks;
+			shrink(0);
+		} else if (s->stale || quit) {
+			memset(s, 0, sizeof(*s));
+		} else {
+			s->failed = 1;	/* do not retry it at once */
+			s->used = ++ticks;
+		}
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/* cancel the renders of the main thread if there is input */
+static void *watcher(void *arg)
+{
+	int n;
+	pthread_mutex_lock(&lock);
+	while (!quit) {
+		if (!rendering || cancelled || !watch) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		pthread_mutex_unlock(&lock);
+		n = watch(WATCHMS);
+		pthread_mutex_lock(&lock);
+		if (n && rendering && !cancelled) {
+			cancelled = 1;
+			doc_cancel(doc, 1);
+			pthread_cond_broadcast(&cond);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/* cancel the workers rendering pages no longer wanted */
+static void cancel_stale(void)
+{
+	int i;
+	for (i = 0; i < NSLOTS; i++) {
+		if (slots[i].busy && (quit || !wanted(&slots[i]))) {
+			slots[i].stale = 1;
+			doc_cancel(docs[slots[i].busy - 1], 1);
+		}
+	}
+}
+
+/* count the pages in another handle; it may take long for large documents */
+static void *counter(void *arg)
+{
+	struct count *c = arg;
+	int n = doc_pages(c->doc);
+	doc_close(c->doc);
+	pthread_mutex_lock(&lock);
+	if (c->id == count_id)
+		npages = n;
+	pthread_mutex_unlock(&lock);
+	free(c);
+	return NULL;
+}
+
+static void count_start(void)
+{
+	struct count *c = malloc(sizeof(*c));
+	pthread_t thread;
+	npages = -1;
+	count_id++;
+	if (c && (c->doc = doc_clone(doc))) {
+		c->id = count_id;
+		if (!pthread_create(&thread, NULL, counter, c)) {
+			pthread_detach(thread);
+			return;
+		}
+		doc_close(c->doc);
+	}
+	free(c);
+	npages = doc_pages(doc);
+}
+
+int render_init(struct doc *maindoc, int workers, long size)
+{
+	doc = maindoc;
+	budget = size;
+	quit = 0;
+	nwant = 0;
+	nwtiles = 0;
+	cancelled = 0;
+	count_start();
+	docs = malloc(workers * sizeof(docs[0]));
+	threads = malloc(workers * sizeof(threads[0]));
+	for (nthreads = 0; nthreads < workers; nthreads++) {
+		if (!(docs[nthreads] = doc_clone(doc)))
+			break;
+		if (pthread_create(&threads[nthreads], NULL, worker, (void *) (long) nthreads)) {
+			doc_close(docs[nthreads]);
+			break;
+		}
+	}
+	watching = !pthread_create(&watch_thread, NULL, watcher, NULL);
+	return nthreads;
+}
+
+void render_free(void)
+{
+	int i;
+	pthread_mutex_lock(&lock);
+	quit = 1;
+	cancel_stale();
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	if (watching)
+		pthread_join(watch_thread, NULL);
+	watching = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		doc_close(docs[i]);
+	}
+	for (i = 0; i < NSLOTS; i++)
+		slot_drop(&slots[i]);
+	free(threads);
+	free(docs);
+	threads = NULL;
+	docs = NULL;
+	nthreads = 0;
+}
+
+/* start a render in the main thread unless cancelled; called with lock held */
+static int begin(void)
+{
+	if (cancelled)
+		return 0;
+	misses++;
+	rendering = 1;
+	pthread_cond_broadcast(&cond);
+	return 1;
+}
+
+/*
+ * Return a copy of a cached page or render and cache it.  Pages rendered
+ * here are written to the disk cache by the workers, if any, after the
+ * page is returned.
+ */
+void *render_page(int page, int zoom, int rotate, int *rows, int *cols)
+{
+	struct slot *s;
+	void *pbuf;
+	long size;
+	int unsaved = 0;
+	pthread_mutex_lock(&lock);
+	while ((s = slot_find(page, zoom, rotate, -1, -1)) && s->busy && !cancelled) {
+		rendering = 1;		/* waiting for a worker can be cancelled too */
+		pthread_cond_broadcast(&cond);
+		pthread_cond_wait(&cond, &lock);
+	}
+	rendering = 0;
+	if (s && !s->busy && !s->failed && (pbuf = malloc(slot_size(s)))) {
+		memcpy(pbuf, s->pbuf, slot_size(s));
+		*rows = s->rows;
+		*cols = s->cols;
+		s->used = ++ticks;
+		hits++;
+		pthread_mutex_unlock(&lock);
+		return pbuf;
+	}
+	if (!begin()) {
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+	pthread_mutex_unlock(&lock);
+	pbuf = draw(doc, page, zoom, rotate, -1, -1, rows, cols, nthreads ? &unsaved : NULL);
+	pthread_mutex_lock(&lock);
+	rendering = 0;
+	if (!pbuf) {
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+	size = (long) *rows * *cols * fbbpp;
+	if ((s = slot_find(page, zoom, rotate, -1, -1)) && s->failed)
+		slot_drop(s);
+	if (slot_find(page, zoom, rotate, -1, -1))
+		unsaved = 0;	/* a worker rendered it too */
+	if (size <= budget && !slot_find(page, zoom, rotate, -1, -1)) {
+		shrink(size);
+		if ((s = slot_new()) && (s->pbuf = malloc(size))) {
+			memcpy(s->pbuf, pbuf, size);
+			s->page = page;
+			s->zoom = zoom;
+			s->rotate = rotate;
+			s->x = -1;
+			s->y = -1;
+			s->rows = *rows;
+			s->cols = *cols;
+			s->used = ++ticks;
+			s->unsaved = unsaved;
+			unsaved = 0;
+			pthread_cond_broadcast(&cond);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	if (unsaved)		/* not cached in memory */
+		disk_save(page, zoom, rotate, pbuf, *rows, *cols);
+	return pbuf;
+}
+
+/* return a w by h tile of the page at x, y; release it with render_untile() */
+void *render_tile(int page, int zoom, int rotate, int x, int y, int w, int h)
+{
+	struct slot *s;
+	void *pbuf;
+	pthread_mutex_lock(&lock);
+	while ((s = slot_find(page, zoom, rotate, x, y)) && s->busy && !cancelled) {
+		rendering = 1;
+		pthread_cond_broadcast(&cond);
+		pthread_cond_wait(&cond, &lock);
+	}
+	rendering = 0;
+	if (s && !s->busy && !s->failed) {
+		s->refs++;
+		s->used = ++ticks;
+		hits++;
+		pthread_mutex_unlock(&lock);
+		return s->pbuf;
+	}
+	if (!begin()) {
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+	pthread_mutex_unlock(&lock);
+	pbuf = draw(doc, page, zoom, rotate, x, y, &h, &w, NULL);
+	pthread_mutex_lock(&lock);
+	rendering = 0;
+	if (!pbuf) {
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+	if ((s = slot_find(page, zoom, rotate, x, y)) && !s->busy && !s->refs)
+		slot_drop(s);
+	shrink((long) w * h * fbbpp);
+	if (!slot_find(page, zoom, rotate, x, y) && (s = slot_new())) {
+		s->page = page;
+		s->zoom = zoom;
+		s->rotate = rotate;
+		s->x = x;
+		s->y = y;
+		s->pbuf = pbuf;
+		s->rows = h;
+		s->cols = w;
+		s->refs = 1;
+		s->used = ++ticks;
+	}
+	pthread_mutex_unlock(&lock);
+	return pbuf;
+}
+
+/* tiles that could not be cached are freed here */
+void render_untile(void *pbuf)
+{
+	int i;
+	if (!pbuf)
+		return;
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < NSLOTS; i++)
+		if (slots[i].page && slots[i].pbuf == pbuf)
+			break;
+	if (i < NSLOTS)
+		slots[i].refs--;
+	else
+		free(pbuf);
+	pthread_mutex_unlock(&lock);
+}
+
+/* ask the workers to render the given pages, most important first */
+void render_want(int *pages, int n, int zoom, int rotate)
+{
+	pthread_mutex_lock(&lock);
+	drop_failed();
+	nwant = n < NWANT ? n : NWANT;
+	memcpy(want, pages, nwant * sizeof(want[0]));
+	want_zoom = zoom;
+	want_rotate = rotate;
+	cancel_stale();
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* tiles to render after the wanted pages; the cached ones are kept */
+void render_tiles(struct tilepos *tiles, int n, int zoom, int rotate)
+{
+	pthread_mutex_lock(&lock);
+	drop_failed();
+	nwtiles = n < NWANTTILES ? n : NWANTTILES;
+	memcpy(wtiles, tiles, nwtiles * sizeof(wtiles[0]));
+	wtile_zoom = zoom;
+	wtile_rotate = rotate;
+	cancel_stale();
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* cancel renders in the main thread when wait(ms) reports input */
+void render_watch(int (*wait)(int ms))
+{
+	pthread_mutex_lock(&lock);
+	watch = wait;
+	pthread_mutex_unlock(&lock);
+}
+
+/* were renders cancelled since the last render_resume()? */
+int render_cancelled(void)
+{
+	int ret;
+	pthread_mutex_lock(&lock);
+	ret = cancelled;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void render_resume(void)
+{
+	pthread_mutex_lock(&lock);
+	cancelled = 0;
+	doc_cancel(doc, 0);
+	pthread_mutex_unlock(&lock);
+}
+
+/* free a page returned by render_page() */
+void render_release(void *pbuf)
+{
+	if (disk_unmap(pbuf))
+		free(pbuf);
+}
+
+/* the number of pages of the document; -1 if not yet known */
+int render_pages(void)
+{
+	int ret;
+	pthread_mutex_lock(&lock);
+	ret = npages;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void render_stats(int *hit, int *miss)
+{
+	pthread_mutex_lock(&lock);
+	*hit = hits;
+	*miss = misses;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,19 @@
+/* background rendering and caching of pages */
+struct tilepos {
+	int page;
+	int x, y, w, h;
+};
+
+int render_init(struct doc *doc, int workers, long size);
+void render_free(void);
+void *render_page(int page, int zoom, int rotate, int *rows, int *cols);
+void *render_tile(int page, int zoom, int rotate, int x, int y, int w, int h);
+void render_untile(void *pbuf);
+void render_release(void *pbuf);
+void render_want(int *pages, int n, int zoom, int rotate);
+void render_tiles(struct tilepos *tiles, int n, int zoom, int rotate);
+int render_pages(void);
+void render_stats(int *hits, int *misses);
+void render_watch(int (*wait)(int ms));
+int render_cancelled(void);
+void render_resume(void);
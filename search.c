@@ -0,0 +1,262 @@
+/*
+ * Searching the text of documents
+ *
+ * The text of the pages is extracted in a low priority thread with its
+ * own handle of the document and kept in memory, so searches do not
+ * wait for doc_text(); pages not yet extracted are extracted by the
+ * searching thread.  Once all pages are extracted, the index is saved
+ * next to the state of the document and loaded when it is opened again,
+ * if the document has not changed.
+ */
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "doc.h"
+#include "session.h"
+#include "search.h"
+
+#define INDEXNICE	19	/* the nice value of the indexing thread */
+
+static struct doc *doc;		/* the handle of the searching thread */
+static struct doc *idoc;	/* the handle of the indexing thread */
+static pthread_t thread;
+static int quit;		/* should the indexing thread stop? */
+static char **texts;		/* the text of each page; NULL if not extracted */
+static int npages;		/* the number of pages; zero if not known */
+static char ipath[1100];	/* the index file; empty if not saved */
+static char id[64];		/* the identity of the document in the index file */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void pages_init(int n)
+{
+	pthread_mutex_lock(&lock);
+	if (!texts && n > 0) {
+		texts = calloc(n + 1, sizeof(texts[0]));
+		npages = texts ? n : 0;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* the number of pages; zero if not known */
+static int pages_count(void)
+{
+	int n;
+	pthread_mutex_lock(&lock);
+	n = npages;
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+/* the text of page p, if extracted */
+static char *text_get(int p)
+{
+	char *s;
+	pthread_mutex_lock(&lock);
+	s = texts && p >= 1 && p <= npages ? texts[p] : NULL;
+	pthread_mutex_unlock(&lock);
+	return s;
+}
+
+/*
+ * Store the text of page p, unless already stored; s is then freed.
+ * Failures are not stored, since extraction may have been cancelled.
+ */
+static char *text_put(int p, char *s)
+{
+	char *ret;
+	if (!s)
+		return "";
+	pthread_mutex_lock(&lock);
+	if (!texts[p])
+		texts[p] = s;
+	else
+		free(s);
+	ret = texts[p];
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+static void index_save(void)
+{
+	char tmp[1108];
+	int n = pages_count();
+	FILE *fp;
+	int i;
+	for (i = 1; i <= n; i++)
+		if (!text_get(i))	/* not extracted */
+			return;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", ipath);
+	if (!ipath[0] || !(fp = fopen(tmp, "w")))
+		return;
+	fprintf(fp, "fbpdf-index %s %d\n", id, n);
+	for (i = 1; i <= n; i++) {
+		fprintf(fp, "page %d %ld\n", i, (long) strlen(text_get(i)));
+		fputs(text_get(i), fp);
+	}
+	if (fclose(fp) || rename(tmp, ipath))
+		remove(tmp);
+}
+
+static int index_load(void)
+{
+	char fid[64];
+	FILE *fp;
+	long len;
+	int i, n, p;
+	if (!ipath[0] || !(fp = fopen(ipath, "r")))
+		return 1;
+	if (fscanf(fp, "fbpdf-index %63s %d\n", fid, &n) != 2 || strcmp(fid, id) || n < 1) {
+		fclose(fp);
+		return 1;
+	}
+	pages_init(n);
+	for (i = 1; i <= n; i++) {
+		char *s;
+		if (fscanf(fp, "page %d %ld\n", &p, &len) != 2 || p != i ||
+				len < 0 || !(s = malloc(len + 1)))
+			break;
+		s[fread(s, 1, len, fp)] = '\0';
+		text_put(i, s);
+	}
+	fclose(fp);
+	return i <= n;
+}
+
+static void *indexer(void *arg)
+{
+	int n;
+	int p;
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), INDEXNICE);
+	pages_init(doc_pages(idoc));
+	n = pages_count();
+	for (p = 1; p <= n && !quit; p++)
+		if (!text_get(p))
+			text_put(p, doc_text(idoc, p));
+	if (p > n && n)
+		index_save();
+	return NULL;
+}
+
+/* start indexing the text of doc, the document at path */
+void search_init(struct doc *maindoc, char *path)
+{
+	struct stat st;
+	char spath[1024];
+	doc = maindoc;
+	quit = 0;
+	ipath[0] = '\0';
+	if (!stat(path, &st) && !session_path(path, spath, sizeof(spath))) {
+		snprintf(ipath, sizeof(ipath), "%s.idx", spath);
+		snprintf(id, sizeof(id), "%lx-%lx", (long) st.st_size, (long) st.st_mtime);
+	}
+	if (!index_load())
+		return;
+	if ((idoc = doc_clone(doc)) && pthread_create(&thread, NULL, indexer, NULL)) {
+		doc_close(idoc);
+		idoc = NULL;
+	}
+}
+
+void search_free(void)
+{
+	int i;
+	pthread_mutex_lock(&lock);
+	quit = 1;
+	if (idoc)
+		doc_cancel(idoc, 1);
+	pthread_mutex_unlock(&lock);
+	if (idoc) {
+		pthread_join(thread, NULL);
+		doc_close(idoc);
+		idoc = NULL;
+	}
+	for (i = 0; texts && i <= npages; i++)
+		free(texts[i]);
+	free(texts);
+	texts = NULL;
+	npages = 0;
+}
+
+/* does pat match s, ignoring case? */
+static int match(char *s, char *pat)
+{
+	while (*pat && *s != '\n' && tolower((unsigned char) *s) == tolower((unsigned char) *pat)) {
+		s++;
+		pat++;
+	}
+	return !*pat;
+}
+
+/*
+ * The first (dir > 0) or the last match of pat at offsets beg to end of
+ * the text of a page, or -1; x and y are the position of its line.
+ */
+static int pagefind(char *text, char *pat, int beg, int end, int dir, int *x, int *y)
+{
+	char *s = text;
+	int found = -1;
+	int lx, ly, n, i;
+	while (*s) {
+		char *eol = strchr(s, '\n');
+		int len = eol ? eol - s : strlen(s);
+		n = 0;
+		if (sscanf(s, "%d %d %n", &lx, &ly, &n) == 2 && n) {
+			for (i = n; i < len; i++) {
+				int off = s - text + i;
+				if (off >= beg && off < end && match(s + i, pat)) {
+					found = off;
+					*x = lx;
+					*y = ly;
+					if (dir > 0)
+						return found;
+				}
+			}
+		}
+		s += len + (eol != NULL);
+	}
+	return found;
+}
+
+/*
+ * Find pat after (dir > 0) or before offset off of the text of page,
+ * wrapping around the document.  On success, page and off specify the
+ * match and x and y the position of its line in BBOX_UNIT.
+ */
+int search_find(char *pat, int dir, int *page, int *off, int *x, int *y)
+{
+	int n = pages_count();
+	int i, p, o;
+	if (!n) {
+		pages_init(doc_pages(doc));
+		n = pages_count();
+	}
+	if (!n || !*pat || *page < 1 || *page > n)
+		return 1;
+	for (i = 0; i <= n; i++) {
+		int beg = 0, end = 1 << 30;
+		char *text;
+		p = (*page - 1 + (dir > 0 ? i : n - i)) % n + 1;
+		if (!(text = text_get(p)))
+			text = text_put(p, doc_text(doc, p));
+		if (i == 0 && dir > 0)
+			beg = *off + 1;
+		if (i == 0 && dir < 0)
+			end = *off;
+		if (i == n && dir > 0)
+			end = *off + 1;
+		if (i == n && dir < 0)
+			beg = *off;
+		if ((o = pagefind(text, pat, beg, end, dir, x, y)) >= 0) {
+			*page = p;
+			*off = o;
+			return 0;
+		}
+	}
+	return 1;
+}
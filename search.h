@@ -0,0 +1,4 @@
+/* searching the text of documents */
+void search_init(struct doc *doc, char *path);
+void search_free(void);
+int search_find(char *pat, int dir, int *page, int *off, int *x, int *y);
@@ -0,0 +1,47 @@
+/*
+ * The files storing the state of documents between runs
+ *
+ * The state of each document is kept in $XDG_STATE_HOME/fbpdf (or
+ * ~/.local/state/fbpdf), in a file named after a hash of the absolute
+ * path of the document.
+ */
+#include <sys/stat.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "session.h"
+
+/* create the directory path and its missing parents */
+void mkdirs(char *path)
+{
+	char *s = path;
+	while ((s = strchr(s + 1, '/'))) {
+		*s = '\0';
+		mkdir(path, 0700);
+		*s = '/';
+	}
+	mkdir(path, 0700);
+}
+
+/* the session file of doc; the directory is created if missing */
+int session_path(char *doc, char *path, int len)
+{
+	char abs[PATH_MAX];
+	char dir[PATH_MAX];
+	unsigned long long h = 14695981039346656037ULL;	/* FNV-1a */
+	char *s;
+	if (!realpath(doc, abs))
+		return 1;
+	for (s = abs; *s; s++)
+		h = (h ^ (unsigned char) *s) * 1099511628211ULL;
+	if (getenv("XDG_STATE_HOME"))
+		snprintf(dir, sizeof(dir), "%s/fbpdf", getenv("XDG_STATE_HOME"));
+	else if (getenv("HOME"))
+		snprintf(dir, sizeof(dir), "%s/.local/state/fbpdf", getenv("HOME"));
+	else
+		return 1;
+	mkdirs(dir);
+	snprintf(path, len, "%s/%016llx", dir, h);
+	return 0;
+}
@@ -0,0 +1,3 @@
+/* the files storing the state of documents between runs */
+int session_path(char *doc, char *path, int len);
+void mkdirs(char *path);
@@ -0,0 +1,198 @@
+/*
+ * Thumbnails of pages
+ *
+ * A thread with its own handle of the document renders the pages at
+ * the largest zoom that fits them in the thumbnail box, the pages
+ * shown first and then those around them.  When the thumbnails use
+ * more memory than allowed, those farthest from the pages shown are
+ * dropped; the thumbnails of the pages shown are never dropped, so
+ * they can be used without holding a lock.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "doc.h"
+#include "thumb.h"
+
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+#define NEAR		256	/* render pages this close to the ones shown */
+
+struct thumb {
+	char *pbuf;		/* the thumbnail in framebuffer format; NULL if missing */
+	int rows, cols;
+	int failed;		/* could not be rendered */
+};
+
+static struct doc *doc;		/* the handle of the thread */
+static struct thumb *thumbs;	/* thumbnails indexed by page number */
+static int npages;		/* the number of pages; zero if not known */
+static int boxrows, boxcols;	/* the thumbnail box */
+static int rotate;
+static int first = 1, last = 1;	/* the pages shown */
+static int reach = NEAR;	/* render pages this close to them, while there is room */
+static long used, limit;	/* the memory used by the thumbnails */
+static int ndone;		/* the number of thumbnails rendered */
+static int quit;
+static pthread_t thread;
+static int running;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static int distance(int p)
+{
+	return p < first ? first - p : (p > last ? p - last : 0);
+}
+
+static int missing(int p)
+{
+	return p >= 1 && p <= npages && !thumbs[p].pbuf && !thumbs[p].failed;
+}
+
+/* the missing page closest to the pages shown, or zero */
+static int nextpage(void)
+{
+	int p, d;
+	for (p = first; p <= last; p++)
+		if (missing(p))
+			return p;
+	for (d = 1; d <= reach; d++) {
+		if (missing(last + d))
+			return last + d;
+		if (missing(first - d))
+			return first - d;
+	}
+	return 0;
+}
+
+/* make room for n bytes by dropping thumbnails farther than d from the pages shown */
+static int shrink(long n, int d)
+{
+	int far, p;
+	while (used + n > limit) {
+		far = 0;
+		for (p = 1; p <= npages; p++)
+			if (thumbs[p].pbuf && distance(p) > d &&
+					(!far || distance(p) > distance(far)))
+				far = p;
+		if (!far)
+			return 1;
+		used -= (long) thumbs[far].rows * thumbs[far].cols * fbbpp;
+		free(thumbs[far].pbuf);
+		thumbs[far].pbuf = NULL;
+	}
+	return 0;
+}
+
+static void *thumber(void *arg)
+{
+	int n = doc_pages(doc);
+	int p, z, rows, cols;
+	char *pbuf;
+	pthread_mutex_lock(&lock);
+	thumbs = calloc(n + 1, sizeof(thumbs[0]));
+	npages = thumbs ? n : 0;
+	while (!quit) {
+		if (!(p = nextpage())) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		pthread_mutex_unlock(&lock);
+		z = 0;
+		if (!doc_size(doc, p, 10, rotate, &rows, &cols) && rows > 0 && cols > 0)
+			z = MAX(1, MIN(boxrows * 10 / rows, boxcols * 10 / cols));
+		pbuf = z ? doc_draw(doc, p, z, rotate, &rows, &cols) : NULL;
+		pthread_mutex_lock(&lock);
+		if (pbuf && distance(p) > 0 && shrink((long) rows * cols * fbbpp, distance(p))) {
+			reach = distance(p) - 1;	/* no room for farther pages */
+			free(pbuf);
+		} else if (pbuf) {
+			thumbs[p].pbuf = pbuf;
+			thumbs[p].rows = rows;
+			thumbs[p].cols = cols;
+			used += (long) rows * cols * fbbpp;
+			ndone++;
+		} else {
+			thumbs[p].failed = !quit;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/* start rendering the thumbnails of doc to fit rows by cols, using at most size bytes */
+int thumb_init(struct doc *maindoc, int rows, int cols, int rot, long size)
+{
+	boxrows = rows;
+	boxcols = cols;
+	rotate = rot;
+	limit = size;
+	quit = 0;
+	first = last = 1;
+	reach = NEAR;
+	if (!(doc = doc_clone(maindoc)))
+		return 1;
+	if (pthread_create(&thread, NULL, thumber, NULL)) {
+		doc_close(doc);
+		return 1;
+	}
+	running = 1;
+	return 0;
+}
+
+void thumb_free(void)
+{
+	int i;
+	if (!running)
+		return;
+	pthread_mutex_lock(&lock);
+	quit = 1;
+	doc_cancel(doc, 1);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	doc_close(doc);
+	for (i = 0; thumbs && i <= npages; i++)
+		free(thumbs[i].pbuf);
+	free(thumbs);
+	thumbs = NULL;
+	npages = 0;
+	used = 0;
+	ndone = 0;
+	running = 0;
+}
+
+/* pages p0 to p1 are shown; they are rendered first and kept */
+void thumb_want(int p0, int p1)
+{
+	pthread_mutex_lock(&lock);
+	first = p0;
+	last = p1;
+	reach = NEAR;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* the thumbnail of page p, if rendered; it is kept while p is shown */
+void *thumb_get(int p, int *rows, int *cols)
+{
+	char *pbuf = NULL;
+	pthread_mutex_lock(&lock);
+	if (p >= 1 && p <= npages && thumbs[p].pbuf) {
+		pbuf = thumbs[p].pbuf;
+		*rows = thumbs[p].rows;
+		*cols = thumbs[p].cols;
+	}
+	pthread_mutex_unlock(&lock);
+	return pbuf;
+}
+
+/* the number of thumbnails rendered; it changes when thumbnails are added */
+int thumb_done(void)
+{
+	int n;
+	pthread_mutex_lock(&lock);
+	n = ndone;
+	pthread_mutex_unlock(&lock);
+	return n;
+}
@@ -0,0 +1,6 @@
+/* rendering thumbnails of pages in the background */
+int thumb_init(struct doc *doc, int rows, int cols, int rotate, long size);
+void thumb_free(void);
+void thumb_want(int first, int last);
+void *thumb_get(int page, int *rows, int *cols);
+int thumb_done(void);
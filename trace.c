@@ -0,0 +1,136 @@
+/*
+ * Timing the hot paths
+ *
+ * Time spent in each part of fbpdf (TR_*) is summed over all threads
+ * for each frame: from the first command after a redraw to the next
+ * redraw.  The latency of recent frames is kept for the status line,
+ * and each frame is written as a line of JSON to the trace file.
+ * Nothing is measured while tracing is disabled: trace_now() returns
+ * zero and trace_lap() ignores intervals starting at zero.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+#define NFRAMES		1024	/* the number of frames kept for percentiles */
+
+static char *names[TR_N] = {"input", "load", "draw", "filter", "raster", "conv"};
+static int enabled;
+static FILE *fp;		/* the trace file */
+static long start;		/* when tracing started */
+static long beg;		/* when the current frame began; zero if none */
+static long cur[TR_N];		/* time spent in the current frame */
+static long lat[NFRAMES];	/* latency of recent frames */
+static long nframes, total;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* enable tracing; frames are written to path, if not NULL */
+int trace_init(char *path)
+{
+	if (path && !(fp = fopen(path, "a")))
+		return 1;
+	trace_enable(1);
+	return 0;
+}
+
+void trace_free(void)
+{
+	if (fp)
+		fclose(fp);
+	fp = NULL;
+}
+
+void trace_enable(int on)
+{
+	if (on && !start)
+		start = now();
+	pthread_mutex_lock(&lock);
+	memset(cur, 0, sizeof(cur));
+	pthread_mutex_unlock(&lock);
+	enabled = on;
+	beg = 0;
+}
+
+int trace_enabled(void)
+{
+	return enabled;
+}
+
+/* the current time in microseconds; zero if tracing is disabled */
+long trace_now(void)
+{
+	return enabled ? now() : 0;
+}
+
+/* add the time since t to what and return the current time */
+long trace_lap(int what, long t)
+{
+	long n = trace_now();
+	if (t && n) {
+		pthread_mutex_lock(&lock);
+		cur[what] += n - t;
+		pthread_mutex_unlock(&lock);
+	}
+	return n;
+}
+
+/* a command read at t changes the screen */
+void trace_begin(long t)
+{
+	if (t && !beg)
+		beg = t;
+}
+
+/* the screen is updated */
+void trace_end(int page, int zoom)
+{
+	long n = trace_now();
+	long spent[TR_N];
+	int i;
+	if (!n || !beg)
+		return;
+	pthread_mutex_lock(&lock);
+	memcpy(spent, cur, sizeof(spent));
+	memset(cur, 0, sizeof(cur));
+	pthread_mutex_unlock(&lock);
+	lat[nframes++ % NFRAMES] = n - beg;
+	total += n - beg;
+	if (fp) {
+		fprintf(fp, "{\"ts\":%ld,\"page\":%d,\"zoom\":%d,\"frame\":%.3f",
+			beg - start, page, zoom * 10, (n - beg) / 1000.);
+		for (i = 0; i < TR_N; i++)
+			fprintf(fp, ",\"%s\":%.3f", names[i], spent[i] / 1000.);
+		fprintf(fp, "}\n");
+		fflush(fp);
+	}
+	beg = 0;
+}
+
+static int longcmp(const void *v1, const void *v2)
+{
+	long l1 = *(long *) v1;
+	long l2 = *(long *) v2;
+	return l1 < l2 ? -1 : l1 > l2;
+}
+
+/* the latency of the last frame, its average, and its 99th percentile */
+void trace_stats(long *last, long *avg, long *p99)
+{
+	long sorted[NFRAMES];
+	int n = nframes < NFRAMES ? nframes : NFRAMES;
+	*last = nframes ? lat[(nframes - 1) % NFRAMES] : 0;
+	*avg = nframes ? total / nframes : 0;
+	memcpy(sorted, lat, n * sizeof(sorted[0]));
+	qsort(sorted, n, sizeof(sorted[0]), longcmp);
+	*p99 = n ? sorted[(n * 99 - 1) / 100] : 0;
+}
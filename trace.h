@@ -0,0 +1,18 @@
+/* timing the hot paths */
+#define TR_INPUT	0	/* handling commands */
+#define TR_LOAD		1	/* loading the pages to show */
+#define TR_DRAW		2	/* updating the framebuffer */
+#define TR_FILTER	3	/* applying colour transforms while drawing */
+#define TR_RASTER	4	/* rasterizing pages in the backend */
+#define TR_CONV		5	/* converting rendered pixels to framebuffer values */
+#define TR_N		6
+
+int trace_init(char *path);
+void trace_free(void);
+void trace_enable(int on);
+int trace_enabled(void);
+long trace_now(void);
+long trace_lap(int what, long t);
+void trace_begin(long t);
+void trace_end(int page, int zoom);
+void trace_stats(long *last, long *avg, long *p99);